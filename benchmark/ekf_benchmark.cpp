@@ -0,0 +1,457 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <benchmark/benchmark.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+#include <kalman_filter_localization/ekf_batch.hpp>
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "allocation_counter.hpp"
+
+namespace
+{
+/*
+* reports the heap allocations between construction and destruction as allocs_per_op,
+* counted on the benchmark thread by test/allocation_counter.cpp
+*/
+class AllocationCounter
+{
+public:
+  explicit AllocationCounter(benchmark::State & state)
+  : state_(state), start_(kalman_filter_localization::test::numAllocations()) {}
+
+  ~AllocationCounter()
+  {
+    state_.counters["allocs_per_op"] = benchmark::Counter(
+      static_cast<double>(kalman_filter_localization::test::numAllocations() - start_),
+      benchmark::Counter::kAvgIterations);
+  }
+
+private:
+  benchmark::State & state_;
+  const uint64_t start_;
+};
+
+/*
+* Level circular drive at constant speed, sampled like a logged run:
+* IMU at imu_rate, GNSS position (with white noise) every gnss_decimation samples.
+*/
+struct Trajectory
+{
+  struct Sample
+  {
+    double stamp;
+    Eigen::Vector3d gyro;
+    Eigen::Vector3d acc;
+    Eigen::Vector3d position;
+    bool has_gnss;
+    Eigen::Vector3d gnss;
+  };
+
+  Trajectory(const double duration, const double imu_rate, const int gnss_decimation)
+  {
+    const double radius = 20.0;
+    const double speed = 5.0;
+    const double yaw_rate = speed / radius;
+    const double gravity = 9.80665;
+    std::mt19937 engine(0);
+    std::normal_distribution<double> gnss_noise(0.0, 0.1);
+
+    const int num_samples = static_cast<int>(duration * imu_rate);
+    samples.reserve(num_samples);
+    for (int i = 1; i <= num_samples; ++i) {
+      Sample sample;
+      sample.stamp = i / imu_rate;
+      const double yaw = yaw_rate * sample.stamp;
+      sample.gyro = Eigen::Vector3d(0, 0, yaw_rate);
+      sample.acc = Eigen::Vector3d(0, speed * yaw_rate, gravity);
+      sample.position =
+        Eigen::Vector3d(radius * std::sin(yaw), radius * (1 - std::cos(yaw)), 0);
+      sample.has_gnss = (i % gnss_decimation == 0);
+      sample.gnss = sample.position +
+        Eigen::Vector3d(gnss_noise(engine), gnss_noise(engine), gnss_noise(engine));
+      samples.push_back(sample);
+    }
+    initial_velocity = Eigen::Vector3d(speed, 0, 0);
+  }
+
+  std::vector<Sample> samples;
+  Eigen::Vector3d initial_velocity;
+};
+
+template<typename Estimator>
+void initialize(Estimator & ekf, const Trajectory & trajectory)
+{
+  typedef typename Estimator::Scalar Scalar;
+  typename Estimator::StateVector x = Estimator::StateVector::Zero();
+  x.template segment<3>(3) = trajectory.initial_velocity.cast<Scalar>();
+  x(9) = 1;
+  ekf.setVarImuGyro(0.01);
+  ekf.setVarImuAcc(0.01);
+  ekf.setInitialX(x);
+}
+
+template<typename Scalar>
+void BM_PredictionUpdate(benchmark::State & state)
+{
+  typedef EKFEstimatorT<Scalar> Estimator;
+  typedef typename Estimator::Vector3 Vector3;
+  Estimator ekf;
+  const Vector3 gyro(Scalar(0.01), Scalar(-0.02), Scalar(0.25));
+  const Vector3 acc(Scalar(0.1), Scalar(1.25), Scalar(9.81));
+  double stamp = 0.0;
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    stamp += 0.001;
+    ekf.predictionUpdate(stamp, gyro, acc);
+    benchmark::DoNotOptimize(ekf.getCoveriance().data());
+  }
+}
+BENCHMARK_TEMPLATE(BM_PredictionUpdate, double);
+BENCHMARK_TEMPLATE(BM_PredictionUpdate, float);
+
+/* range(0) selects the sequential scalar update (1) or the joint update with a 3x3 inverse (0) */
+template<typename Scalar>
+void BM_ObservationUpdate(benchmark::State & state)
+{
+  typedef EKFEstimatorT<Scalar> Estimator;
+  typedef typename Estimator::Vector3 Vector3;
+  Estimator ekf;
+  ekf.setSequentialUpdate(state.range(0) != 0);
+  const Vector3 y(Scalar(0.1), Scalar(0.2), Scalar(0.3));
+  const Vector3 variance(Scalar(0.1), Scalar(0.1), Scalar(0.15));
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    ekf.observationUpdateDiagonal(y, variance);
+    benchmark::DoNotOptimize(ekf.getCoveriance().data());
+  }
+}
+BENCHMARK_TEMPLATE(BM_ObservationUpdate, double)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_ObservationUpdate, float)->Arg(0)->Arg(1);
+
+template<typename Scalar>
+void BM_SquareRootPredictionUpdate(benchmark::State & state)
+{
+  typedef EKFEstimatorT<Scalar> Estimator;
+  typedef typename Estimator::Vector3 Vector3;
+  Estimator ekf(Estimator::CovarianceForm::SQUARE_ROOT);
+  const Vector3 gyro(Scalar(0.01), Scalar(-0.02), Scalar(0.25));
+  const Vector3 acc(Scalar(0.1), Scalar(1.25), Scalar(9.81));
+  double stamp = 0.0;
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    stamp += 0.001;
+    ekf.predictionUpdate(stamp, gyro, acc);
+    benchmark::DoNotOptimize(ekf.getX().data());
+  }
+}
+BENCHMARK_TEMPLATE(BM_SquareRootPredictionUpdate, double);
+BENCHMARK_TEMPLATE(BM_SquareRootPredictionUpdate, float);
+
+template<typename Scalar>
+void BM_SquareRootObservationUpdate(benchmark::State & state)
+{
+  typedef EKFEstimatorT<Scalar> Estimator;
+  typedef typename Estimator::Vector3 Vector3;
+  Estimator ekf(Estimator::CovarianceForm::SQUARE_ROOT);
+  const Vector3 y(Scalar(0.1), Scalar(0.2), Scalar(0.3));
+  const Vector3 variance(Scalar(0.1), Scalar(0.1), Scalar(0.15));
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    ekf.observationUpdateDiagonal(y, variance);
+    benchmark::DoNotOptimize(ekf.getX().data());
+  }
+}
+BENCHMARK_TEMPLATE(BM_SquareRootObservationUpdate, double);
+BENCHMARK_TEMPLATE(BM_SquareRootObservationUpdate, float);
+
+/*
+* range(0): IMU period [usec], range(1): yaw rate [deg/s]; the rate decides whether
+* quaternionExp takes its Taylor or its sin/cos branch
+*/
+void BM_PredictionUpdateDt(benchmark::State & state)
+{
+  EKFEstimator ekf;
+  const double dt = state.range(0) * 1e-6;
+  const Eigen::Vector3d gyro(0.01, -0.02, state.range(1) * M_PI / 180);
+  const Eigen::Vector3d acc(0.1, 1.25, 9.81);
+  double stamp = 0.0;
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    stamp += dt;
+    ekf.predictionUpdate(stamp, gyro, acc);
+    benchmark::DoNotOptimize(ekf.getX().data());
+  }
+}
+BENCHMARK(BM_PredictionUpdateDt)->ArgsProduct({{100, 1000, 10000}, {10, 200, 2000}});
+
+/*
+* range(0): log10 of the IMU noise variances, range(1): log10 of the observation
+* variance; the cost should not depend on either
+*/
+void BM_PredictUpdateNoise(benchmark::State & state)
+{
+  EKFEstimator ekf;
+  const double var_imu = std::pow(10.0, state.range(0));
+  ekf.setVarImuGyro(var_imu);
+  ekf.setVarImuAcc(var_imu);
+  const Eigen::Vector3d variance = Eigen::Vector3d::Constant(std::pow(10.0, state.range(1)));
+  const Eigen::Vector3d gyro(0.01, -0.02, 0.25);
+  const Eigen::Vector3d acc(0.1, 1.25, 9.81);
+  const Eigen::Vector3d y(0.1, 0.2, 0.3);
+  double stamp = 0.0;
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    stamp += 0.001;
+    ekf.predictionUpdate(stamp, gyro, acc);
+    ekf.observationUpdateDiagonal(y, variance);
+    benchmark::DoNotOptimize(ekf.getX().data());
+  }
+}
+BENCHMARK(BM_PredictUpdateNoise)->ArgsProduct({{-6, -2, 2}, {-4, 0, 4}});
+
+/* construction and setInitialX; range(0) is the history capacity reserved up front */
+template<typename Scalar>
+void BM_Initialization(benchmark::State & state)
+{
+  typedef EKFEstimatorT<Scalar> Estimator;
+  typename Estimator::StateVector x = Estimator::StateVector::Zero();
+  x(9) = 1;
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    Estimator ekf;
+    ekf.setHistoryCapacity(static_cast<size_t>(state.range(0)));
+    ekf.setInitialX(x);
+    benchmark::DoNotOptimize(ekf.getX().data());
+  }
+}
+BENCHMARK_TEMPLATE(BM_Initialization, double)->Arg(0)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_Initialization, float)->Arg(0)->Arg(1000);
+
+void BM_GetX(benchmark::State & state)
+{
+  EKFEstimator ekf;
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ekf.getX().data());
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_GetX);
+
+/*
+* getCoveriance right after a prediction, i.e. including the work it defers:
+* range(0) = 0: DENSE form, 1: DENSE with 10 samples preintegrated, 2: SQUARE_ROOT (S S^T)
+*/
+void BM_GetCovariance(benchmark::State & state)
+{
+  EKFEstimator ekf(
+    state.range(0) == 2 ? EKFEstimator::CovarianceForm::SQUARE_ROOT :
+    EKFEstimator::CovarianceForm::DENSE);
+  ekf.setPreintegrationBatchSize(state.range(0) == 1 ? 10 : 1);
+  const Eigen::Vector3d gyro(0.01, -0.02, 0.25);
+  const Eigen::Vector3d acc(0.1, 1.25, 9.81);
+  double stamp = 0.0;
+  AllocationCounter allocation_counter(state);
+  for (auto _ : state) {
+    state.PauseTiming();
+    stamp += 0.001;
+    ekf.predictionUpdate(stamp, gyro, acc);
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(ekf.getCoveriance().data());
+  }
+}
+BENCHMARK(BM_GetCovariance)->Arg(0)->Arg(1)->Arg(2);
+
+/*
+* range(0) filters stepped one IMU sample (and one GNSS fix every 10th iteration),
+* as independent EKFEstimatorT instances and as one EKFEstimatorBatchT.
+* items_per_second counts filter steps.
+*/
+template<typename Scalar>
+void BM_IndependentFilters(benchmark::State & state)
+{
+  typedef EKFEstimatorT<Scalar> Estimator;
+  typedef typename Estimator::Vector3 Vector3;
+  std::vector<Estimator, Eigen::aligned_allocator<Estimator>> ekfs(state.range(0));
+  const Vector3 gyro(Scalar(0.01), Scalar(-0.02), Scalar(0.25));
+  const Vector3 acc(Scalar(0.1), Scalar(1.25), Scalar(9.81));
+  const Vector3 y(Scalar(0.1), Scalar(0.2), Scalar(0.3));
+  const Vector3 variance(Scalar(0.1), Scalar(0.1), Scalar(0.15));
+  double stamp = 0.0;
+  int count = 0;
+  for (auto _ : state) {
+    stamp += 0.001;
+    for (auto & ekf : ekfs) {
+      ekf.predictionUpdate(stamp, gyro, acc);
+      if (count % 10 == 0) {
+        ekf.observationUpdateDiagonal(y, variance);
+      }
+    }
+    ++count;
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_IndependentFilters, double)->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_TEMPLATE(BM_IndependentFilters, float)->RangeMultiplier(8)->Range(8, 4096);
+
+template<typename Scalar>
+void BM_BatchFilters(benchmark::State & state)
+{
+  typedef EKFEstimatorBatchT<Scalar> Batch;
+  const Eigen::Index num_filters = state.range(0);
+  Batch batch(num_filters);
+  typename Batch::Lanes3 gyro(num_filters, 3), acc(num_filters, 3);
+  typename Batch::Lanes3 y(num_filters, 3), variance(num_filters, 3);
+  gyro.rowwise() = Eigen::Array<Scalar, 1, 3>(Scalar(0.01), Scalar(-0.02), Scalar(0.25));
+  acc.rowwise() = Eigen::Array<Scalar, 1, 3>(Scalar(0.1), Scalar(1.25), Scalar(9.81));
+  y.rowwise() = Eigen::Array<Scalar, 1, 3>(Scalar(0.1), Scalar(0.2), Scalar(0.3));
+  variance.rowwise() = Eigen::Array<Scalar, 1, 3>(Scalar(0.1), Scalar(0.1), Scalar(0.15));
+  double stamp = 0.0;
+  int count = 0;
+  for (auto _ : state) {
+    stamp += 0.001;
+    batch.predictionUpdate(stamp, gyro, acc);
+    if (count % 10 == 0) {
+      batch.observationUpdate(y, variance);
+    }
+    ++count;
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * num_filters);
+}
+BENCHMARK_TEMPLATE(BM_BatchFilters, double)->RangeMultiplier(8)->Range(8, 4096);
+BENCHMARK_TEMPLATE(BM_BatchFilters, float)->RangeMultiplier(8)->Range(8, 4096);
+
+/* the sequential X-Y-Z Euler product the prediction used before quaternionExp */
+Eigen::Quaterniond eulerIncrement(const Eigen::Vector3d & theta)
+{
+  return Eigen::Quaterniond(
+    Eigen::AngleAxisd(theta.x(), Eigen::Vector3d::UnitX()) *
+    Eigen::AngleAxisd(theta.y(), Eigen::Vector3d::UnitY()) *
+    Eigen::AngleAxisd(theta.z(), Eigen::Vector3d::UnitZ()));
+}
+
+/*
+* Gyro increment of a 1 kHz IMU rotating at range(0) rad/s about a skewed axis.
+* max_err_rad is the worst angle to the exact rotation-vector exponential
+* (Eigen::AngleAxisd of the same vector) over one revolution.
+*/
+template<Eigen::Quaterniond(*Increment)(const Eigen::Vector3d &)>
+void BM_QuaternionIncrement(benchmark::State & state)
+{
+  const double rate = static_cast<double>(state.range(0));
+  const double dt = 0.001;
+  const int num_steps = static_cast<int>(2 * M_PI / (rate * dt));
+  std::vector<Eigen::Vector3d> increments;
+  for (int i = 0; i < num_steps; ++i) {
+    const double phase = 2 * M_PI * i / num_steps;
+    increments.push_back(
+      rate * dt * Eigen::Vector3d(std::cos(phase), std::sin(phase), 1.0).normalized());
+  }
+
+  double max_error = 0.0;
+  for (const auto & theta : increments) {
+    const Eigen::Quaterniond exact(Eigen::AngleAxisd(theta.norm(), theta.normalized()));
+    max_error = std::max(max_error, Increment(theta).angularDistance(exact));
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Increment(increments[i]));
+    i = (i + 1 == increments.size()) ? 0 : i + 1;
+  }
+  state.counters["max_err_rad"] = max_error;
+}
+BENCHMARK_TEMPLATE(BM_QuaternionIncrement, eulerIncrement)->Arg(1)->Arg(10)->Arg(30);
+BENCHMARK_TEMPLATE(BM_QuaternionIncrement, EKFEstimator::quaternionExp)->Arg(1)->Arg(10)->Arg(30);
+
+/*
+* Runs the double and the float filter over the same trajectory and reports
+* how far the float estimate drifts from the double one, and how far each is from
+* the ground truth.
+*/
+void BM_FloatAccuracy(benchmark::State & state)
+{
+  const Trajectory trajectory(static_cast<double>(state.range(0)), 1000.0, 100);
+  double max_position_diff = 0.0;
+  double max_attitude_diff = 0.0;
+  double rmse_double = 0.0;
+  double rmse_float = 0.0;
+  for (auto _ : state) {
+    EKFEstimator ekf_double;
+    EKFEstimatorf ekf_float;
+    initialize(ekf_double, trajectory);
+    initialize(ekf_float, trajectory);
+    max_position_diff = 0.0;
+    max_attitude_diff = 0.0;
+    double sse_double = 0.0;
+    double sse_float = 0.0;
+    for (const auto & sample : trajectory.samples) {
+      ekf_double.predictionUpdate(sample.stamp, sample.gyro, sample.acc);
+      ekf_float.predictionUpdate(sample.stamp, sample.gyro.cast<float>(), sample.acc.cast<float>());
+      if (sample.has_gnss) {
+        const Eigen::Vector3d variance(0.01, 0.01, 0.01);
+        ekf_double.observationUpdateDiagonal(sample.gnss, variance);
+        ekf_float.observationUpdateDiagonal(sample.gnss.cast<float>(), variance.cast<float>());
+      }
+      const Eigen::Matrix<double, 10, 1> x_double = ekf_double.getX();
+      const Eigen::Matrix<double, 10, 1> x_float = ekf_float.getX().cast<double>();
+      max_position_diff =
+        std::max(max_position_diff, (x_double.head<3>() - x_float.head<3>()).norm());
+      const Eigen::Quaterniond q_double(x_double.tail<4>());
+      const Eigen::Quaterniond q_float(x_float.tail<4>());
+      max_attitude_diff = std::max(max_attitude_diff, q_double.angularDistance(q_float));
+      sse_double += (x_double.head<3>() - sample.position).squaredNorm();
+      sse_float += (x_float.head<3>() - sample.position).squaredNorm();
+    }
+    rmse_double = std::sqrt(sse_double / trajectory.samples.size());
+    rmse_float = std::sqrt(sse_float / trajectory.samples.size());
+  }
+  state.counters["max_pos_diff_m"] = max_position_diff;
+  state.counters["max_att_diff_rad"] = max_attitude_diff;
+  state.counters["rmse_double_m"] = rmse_double;
+  state.counters["rmse_float_m"] = rmse_float;
+  state.SetItemsProcessed(state.iterations() * trajectory.samples.size());
+}
+BENCHMARK(BM_FloatAccuracy)->Arg(60)->Arg(600)->Unit(benchmark::kMillisecond);
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,298 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+/*
+* Closed-loop simulation: runs EKFEstimator over the streams of Simulator and reports the
+* estimation error against ground truth next to the throughput, so a speed change can be
+* checked for accuracy regressions in the same run.
+*
+* ekf_simulation [--name value ...]
+*
+* options (defaults in brackets):
+*   --trajectory [figure_eight] figure_eight, line or spline
+*   --duration [600] --imu_rate [100] --gnss_rate [1] --odom_rate [10] --speed [5] --size [50]
+*   --gyro_noise [0.005] --acc_noise [0.05] --gyro_bias [0.001] --acc_bias [0.02]
+*   --gyro_bias_walk [0] --acc_bias_walk [0] --gnss_noise_xy [0.3] --gnss_noise_z [0.4]
+*   --odom_noise [0.01] --odom_scale_error [0.01] --seed [0]
+*   --use_gnss [1] --use_odom [0]
+*   --var_imu_w [0.01] --var_imu_acc [0.01] --var_gnss_xy [0.1] --var_gnss_z [0.15]
+*   --var_odom_xyz [0.2] (filter settings, as the node parameters)
+*   --preintegration_batch_size [1] --use_square_root_filter [0] --use_float [0]
+*   --repeat [5] runs over the same streams; the fastest one is reported
+*
+* The filter starts at the true initial state. Errors are taken after every imu sample.
+*/
+#include <kalman_filter_localization/ekf.hpp>
+
+#include "simulator.hpp"
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+class Options
+{
+public:
+  Options(int argc, char ** argv)
+  {
+    for (int i = 1; i + 1 < argc; i += 2) {
+      std::string name = argv[i];
+      if (name.rfind("--", 0) != 0) {
+        throw std::invalid_argument("unexpected argument " + name);
+      }
+      values_[name.substr(2)] = argv[i + 1];
+    }
+    if (argc % 2 == 0) {
+      throw std::invalid_argument(std::string("missing value for ") + argv[argc - 1]);
+    }
+  }
+
+  std::string get(const std::string & name, const std::string & default_value) const
+  {
+    auto it = values_.find(name);
+    return it == values_.end() ? default_value : it->second;
+  }
+
+  double get(const std::string & name, const double default_value) const
+  {
+    auto it = values_.find(name);
+    return it == values_.end() ? default_value : std::stod(it->second);
+  }
+
+private:
+  std::map<std::string, std::string> values_;
+};
+
+Simulator::Config toConfig(const Options & options)
+{
+  Simulator::Config config;
+  const std::string trajectory = options.get("trajectory", std::string("figure_eight"));
+  if (trajectory == "figure_eight") {
+    config.trajectory = Simulator::Trajectory::FIGURE_EIGHT;
+  } else if (trajectory == "line") {
+    config.trajectory = Simulator::Trajectory::LINE;
+  } else if (trajectory == "spline") {
+    config.trajectory = Simulator::Trajectory::SPLINE;
+  } else {
+    throw std::invalid_argument("unknown trajectory " + trajectory);
+  }
+  config.duration = options.get("duration", config.duration);
+  config.imu_rate = options.get("imu_rate", config.imu_rate);
+  config.gnss_rate = options.get("gnss_rate", config.gnss_rate);
+  config.odom_rate = options.get("odom_rate", config.odom_rate);
+  config.speed = options.get("speed", config.speed);
+  config.size = options.get("size", config.size);
+  config.gyro_noise = options.get("gyro_noise", config.gyro_noise);
+  config.acc_noise = options.get("acc_noise", config.acc_noise);
+  config.gyro_bias = options.get("gyro_bias", config.gyro_bias);
+  config.acc_bias = options.get("acc_bias", config.acc_bias);
+  config.gyro_bias_walk = options.get("gyro_bias_walk", config.gyro_bias_walk);
+  config.acc_bias_walk = options.get("acc_bias_walk", config.acc_bias_walk);
+  config.gnss_noise_xy = options.get("gnss_noise_xy", config.gnss_noise_xy);
+  config.gnss_noise_z = options.get("gnss_noise_z", config.gnss_noise_z);
+  config.odom_noise = options.get("odom_noise", config.odom_noise);
+  config.odom_scale_error = options.get("odom_scale_error", config.odom_scale_error);
+  config.seed = static_cast<uint32_t>(options.get("seed", 0.0));
+  if (config.duration <= 0 || config.imu_rate <= 0 || config.speed <= 0 || config.size <= 0) {
+    throw std::invalid_argument("duration, imu_rate, speed and size must be positive");
+  }
+  return config;
+}
+
+enum STATE {
+  X = 0,
+  Y = 1,
+  Z = 2,
+  VX = 3,
+  VY = 4,
+  VZ = 5,
+  QX = 6,
+  QY = 7,
+  QZ = 8,
+  QW = 9,
+};
+
+struct Result
+{
+  double wall_time;  // [sec], of the filter loop only
+  std::vector<Eigen::Matrix<double, 10, 1>> estimates;  // after every imu sample
+};
+
+template<typename Estimator>
+Result run(const Options & options, const Simulator & simulator)
+{
+  typedef typename Estimator::Scalar Scalar;
+  typedef typename Estimator::Vector3 Vector3;
+  typedef typename Estimator::StateVector StateVector;
+
+  const bool use_gnss = options.get("use_gnss", 1.0) != 0.0;
+  const bool use_odom = options.get("use_odom", 0.0) != 0.0;
+  const double var_gnss_xy = options.get("var_gnss_xy", 0.1);
+  const Vector3 var_gnss = Eigen::Vector3d(
+    var_gnss_xy, var_gnss_xy, options.get("var_gnss_z", 0.15)).cast<Scalar>();
+  const Vector3 var_odom = Vector3::Constant(Scalar(options.get("var_odom_xyz", 0.2)));
+
+  Estimator ekf(
+    options.get("use_square_root_filter", 0.0) != 0.0 ?
+    Estimator::CovarianceForm::SQUARE_ROOT : Estimator::CovarianceForm::DENSE);
+  ekf.setVarImuGyro(options.get("var_imu_w", 0.01));
+  ekf.setVarImuAcc(options.get("var_imu_acc", 0.01));
+  ekf.setPreintegrationBatchSize(static_cast<int>(options.get("preintegration_batch_size", 1.0)));
+
+  const Simulator::State & initial = simulator.groundTruth().front();
+  StateVector x;
+  x.template segment<3>(STATE::X) = initial.position.cast<Scalar>();
+  x.template segment<3>(STATE::VX) = initial.velocity.cast<Scalar>();
+  x.template segment<4>(STATE::QX) = initial.orientation.coeffs().cast<Scalar>();
+  ekf.setInitialX(x);
+
+  Result result;
+  result.estimates.resize(simulator.groundTruth().size());
+  result.estimates.front() = x.template cast<double>();
+  bool has_previous_odom = false;
+  Eigen::Isometry3d previous_odom = Eigen::Isometry3d::Identity();
+  Eigen::Isometry3d pose_at_previous_odom = Eigen::Isometry3d::Identity();
+
+  const auto wall_start = std::chrono::steady_clock::now();
+  for (const Simulator::Measurement & measurement : simulator.measurements()) {
+    if (measurement.type == Simulator::Measurement::IMU) {
+      ekf.predictionUpdate(
+        measurement.stamp, measurement.first.cast<Scalar>(), measurement.second.cast<Scalar>());
+      result.estimates[measurement.truth_index] = ekf.getX().template cast<double>();
+    } else if (measurement.type == Simulator::Measurement::GNSS) {
+      if (use_gnss) {
+        ekf.observationUpdateDiagonal(measurement.first.cast<Scalar>(), var_gnss);
+      }
+    } else if (use_odom) {
+      // odometry increment applied to the filter pose at the previous odometry sample,
+      // as in the node
+      Eigen::Isometry3d odom = Eigen::Isometry3d::Identity();
+      odom.translation() = measurement.first;
+      odom.linear() = measurement.orientation.toRotationMatrix();
+      if (has_previous_odom) {
+        const Eigen::Isometry3d predicted = pose_at_previous_odom * previous_odom.inverse() * odom;
+        ekf.observationUpdateDiagonal(predicted.translation().cast<Scalar>(), var_odom);
+      }
+      const StateVector & estimate = ekf.getX();
+      pose_at_previous_odom.translation() =
+        estimate.template segment<3>(STATE::X).template cast<double>();
+      pose_at_previous_odom.linear() = Eigen::Quaterniond(
+        estimate(STATE::QW), estimate(STATE::QX), estimate(STATE::QY),
+        estimate(STATE::QZ)).toRotationMatrix();
+      previous_odom = odom;
+      has_previous_odom = true;
+    }
+  }
+  result.wall_time =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  return result;
+}
+
+void report(const Simulator & simulator, const Result & result)
+{
+  const std::vector<Simulator::State> & truth = simulator.groundTruth();
+  double sum_position = 0, sum_horizontal = 0, sum_velocity = 0, sum_attitude = 0;
+  double max_position = 0;
+  for (size_t i = 0; i < truth.size(); ++i) {
+    const Eigen::Matrix<double, 10, 1> & x = result.estimates[i];
+    const Eigen::Vector3d position_error = x.segment<3>(STATE::X) - truth[i].position;
+    const Eigen::Quaterniond orientation(x(STATE::QW), x(STATE::QX), x(STATE::QY), x(STATE::QZ));
+    const double attitude_error = orientation.angularDistance(truth[i].orientation);
+    sum_position += position_error.squaredNorm();
+    sum_horizontal += position_error.head<2>().squaredNorm();
+    sum_velocity += (x.segment<3>(STATE::VX) - truth[i].velocity).squaredNorm();
+    sum_attitude += attitude_error * attitude_error;
+    max_position = std::max(max_position, position_error.norm());
+  }
+  const double n = static_cast<double>(truth.size());
+
+  size_t num_gnss = 0;
+  double sum_gnss = 0;
+  for (const Simulator::Measurement & measurement : simulator.measurements()) {
+    if (measurement.type == Simulator::Measurement::GNSS) {
+      sum_gnss += (measurement.first - simulator.truth(measurement.stamp).position).squaredNorm();
+      ++num_gnss;
+    }
+  }
+
+  const double num_imu = n - 1;
+  const double duration = truth.back().stamp;
+  std::printf(
+    "%.0f imu samples, %lu measurements over %.1f s\n"
+    "throughput: %.1f ns per imu sample, %.0fx real time (%.3f s)\n"
+    "position rmse %.4f m (horizontal %.4f m, max %.4f m)\n"
+    "velocity rmse %.4f m/s, attitude rmse %.4f deg\n",
+    num_imu, static_cast<unsigned long>(simulator.measurements().size() - num_imu),  // NOLINT
+    duration, 1e9 * result.wall_time / num_imu,
+    result.wall_time > 0 ? duration / result.wall_time : 0.0, result.wall_time,
+    std::sqrt(sum_position / n), std::sqrt(sum_horizontal / n), max_position,
+    std::sqrt(sum_velocity / n), std::sqrt(sum_attitude / n) * 180 / M_PI);
+  if (num_gnss > 0) {
+    std::printf("(raw gnss rmse %.4f m)\n", std::sqrt(sum_gnss / num_gnss));
+  }
+}
+}  // namespace
+
+int main(int argc, char ** argv)
+{
+  try {
+    const Options options(argc, argv);
+    const Simulator simulator(toConfig(options));
+    const bool use_float = options.get("use_float", 0.0) != 0.0;
+    const int repeat = std::max(static_cast<int>(options.get("repeat", 5.0)), 1);
+
+    Result best;
+    for (int i = 0; i < repeat; ++i) {
+      Result result = use_float ?
+        run<EKFEstimatorf>(options, simulator) : run<EKFEstimator>(options, simulator);
+      if (i == 0 || result.wall_time < best.wall_time) {
+        best = std::move(result);
+      }
+    }
+    report(simulator, best);
+  } catch (const std::exception & e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef KALMAN_FILTER_LOCALIZATION__SIMULATOR_HPP_
+#define KALMAN_FILTER_LOCALIZATION__SIMULATOR_HPP_
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+/*
+* Deterministic ground truth and sensor streams for benchmarks and accuracy checks.
+*
+* The trajectory is an analytic curve (position, velocity and acceleration in closed form),
+* with the body x axis along the velocity and no roll, so the body rate is exact too.
+* From it the simulator samples, all from one seeded engine:
+*   imu:  gyro = w_b + b_g + n_g, acc = R^T (a + g) + b_a + n_a,
+*         with biases drawn at start and random-walking per sample
+*   gnss: position + white noise
+*   odom: pose in the odom frame (= world at start), integrated from the true increments
+*         with a scale error and noise per increment, so it drifts
+* Noise parameters are standard deviations per sample.
+* The same config and seed always give the same streams.
+*/
+class Simulator
+{
+public:
+  enum class Trajectory { FIGURE_EIGHT, LINE, SPLINE };
+
+  struct Config
+  {
+    Trajectory trajectory{Trajectory::FIGURE_EIGHT};
+    double duration{600.0};  // [sec]
+    double imu_rate{100.0};  // [Hz]
+    double gnss_rate{1.0};  // [Hz], 0 disables
+    double odom_rate{10.0};  // [Hz], 0 disables
+    double speed{5.0};  // [m/s], mean
+    double size{50.0};  // [m], figure-eight half width or spline waypoint spacing
+    double gyro_noise{0.005};  // [rad/s]
+    double acc_noise{0.05};  // [m/s^2]
+    double gyro_bias{0.001};  // [rad/s], initial
+    double acc_bias{0.02};  // [m/s^2], initial
+    double gyro_bias_walk{0.0};  // [rad/s] per sample
+    double acc_bias_walk{0.0};  // [m/s^2] per sample
+    double gnss_noise_xy{0.3};  // [m]
+    double gnss_noise_z{0.4};  // [m]
+    double odom_noise{0.01};  // [m] per increment
+    double odom_scale_error{0.01};
+    uint32_t seed{0};
+  };
+
+  struct State
+  {
+    double stamp;
+    Eigen::Vector3d position;
+    Eigen::Vector3d velocity;
+    Eigen::Vector3d acceleration;
+    Eigen::Quaterniond orientation;
+    Eigen::Vector3d angular_velocity;  // body frame
+  };
+
+  struct Measurement
+  {
+    enum Type { IMU, GNSS, ODOM } type;
+    double stamp;
+    Eigen::Vector3d first;  // gyro or position
+    Eigen::Vector3d second;  // linear acceleration (imu only)
+    Eigen::Quaterniond orientation;  // odom only
+    size_t truth_index;  // into groundTruth(), the latest imu sample at or before stamp
+  };
+
+  explicit Simulator(const Config & config)
+  : config_(config), engine_(config.seed)
+  {
+    if (config_.trajectory == Trajectory::SPLINE) {
+      generateWaypoints();
+    }
+    generate();
+  }
+
+  /* true state at time t [sec] */
+  State truth(const double t) const
+  {
+    State state;
+    state.stamp = t;
+    curve(t, state.position, state.velocity, state.acceleration);
+
+    const Eigen::Vector3d & v = state.velocity;
+    const Eigen::Vector3d & a = state.acceleration;
+    const double vh2 = v.x() * v.x() + v.y() * v.y();
+    const double vh = std::sqrt(vh2);
+    const double yaw = std::atan2(v.y(), v.x());
+    const double pitch = -std::atan2(v.z(), vh);
+    const double yaw_rate = (v.x() * a.y() - v.y() * a.x()) / vh2;
+    const double vh_dot = (v.x() * a.x() + v.y() * a.y()) / vh;
+    const double pitch_rate = -(vh * a.z() - v.z() * vh_dot) / (vh2 + v.z() * v.z());
+
+    // R = Rz(yaw) Ry(pitch), R^T dR/dt = [Ry^T yaw_rate e_z + pitch_rate e_y]x
+    const Eigen::AngleAxisd pitch_rotation(pitch, Eigen::Vector3d::UnitY());
+    state.orientation =
+      Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()) * pitch_rotation;
+    state.angular_velocity = pitch_rotation.inverse() * Eigen::Vector3d(0, 0, yaw_rate) +
+      Eigen::Vector3d(0, pitch_rate, 0);
+    return state;
+  }
+
+  /* all samples in stamp order; at equal stamps the imu sample comes first */
+  const std::vector<Measurement> & measurements() const { return measurements_; }
+
+  /* true state at every imu sample, index 0 at t = 0 before the first sample */
+  const std::vector<State> & groundTruth() const { return ground_truth_; }
+
+  const Config & config() const { return config_; }
+
+private:
+  void curve(const double t, Eigen::Vector3d & p, Eigen::Vector3d & v, Eigen::Vector3d & a) const
+  {
+    switch (config_.trajectory) {
+      case Trajectory::FIGURE_EIGHT: {
+          // lemniscate of Gerono with a gentle climb on each lobe
+          const double r = config_.size;
+          const double h = 0.02 * r;
+          const double w = config_.speed / r;
+          const double s1 = std::sin(w * t), c1 = std::cos(w * t);
+          const double s2 = std::sin(2 * w * t), c2 = std::cos(2 * w * t);
+          p = Eigen::Vector3d(r * s1, 0.5 * r * s2, h * s1);
+          v = w * Eigen::Vector3d(r * c1, r * c2, h * c1);
+          a = -w * w * Eigen::Vector3d(r * s1, 2 * r * s2, h * s1);
+          break;
+        }
+      case Trajectory::LINE: {
+          // slightly climbing straight line, speed oscillating by 20% with a 20 sec period
+          const Eigen::Vector3d direction = Eigen::Vector3d(1, 0, 0.02).normalized();
+          const double w = 2 * M_PI / 20.0;
+          const double amplitude = 0.2 * config_.speed / w;
+          p = (config_.speed * t + amplitude * std::sin(w * t)) * direction;
+          v = (config_.speed + amplitude * w * std::cos(w * t)) * direction;
+          a = (-amplitude * w * w * std::sin(w * t)) * direction;
+          break;
+        }
+      case Trajectory::SPLINE: {
+          // uniform Catmull-Rom spline through the waypoints, one segment per period
+          const double period = config_.size / config_.speed;
+          const size_t segment = std::min(
+            static_cast<size_t>(std::max(t, 0.0) / period), waypoints_.size() - 4);
+          const double u = t / period - segment;
+          const Eigen::Vector3d & p0 = waypoints_[segment];
+          const Eigen::Vector3d & p1 = waypoints_[segment + 1];
+          const Eigen::Vector3d & p2 = waypoints_[segment + 2];
+          const Eigen::Vector3d & p3 = waypoints_[segment + 3];
+          const Eigen::Vector3d c1 = 0.5 * (p2 - p0);
+          const Eigen::Vector3d c2 = 0.5 * (2 * p0 - 5 * p1 + 4 * p2 - p3);
+          const Eigen::Vector3d c3 = 0.5 * (-p0 + 3 * p1 - 3 * p2 + p3);
+          p = p1 + u * (c1 + u * (c2 + u * c3));
+          v = (c1 + u * (2 * c2 + 3 * u * c3)) / period;
+          a = (2 * c2 + 6 * u * c3) / (period * period);
+          break;
+        }
+    }
+  }
+
+  /* random walk with heading changes of at most 60 deg, so the spline never turns back */
+  void generateWaypoints()
+  {
+    std::uniform_real_distribution<double> turn(-M_PI / 3, M_PI / 3);
+    std::normal_distribution<double> climb(0.0, 0.02 * config_.size);
+    const size_t num_segments =
+      static_cast<size_t>(config_.duration * config_.speed / config_.size) + 1;
+    double heading = 0.0;
+    Eigen::Vector3d waypoint(-config_.size, 0, 0);
+    waypoints_.reserve(num_segments + 3);
+    waypoints_.push_back(waypoint);
+    waypoint.setZero();
+    for (size_t i = 0; i < num_segments + 2; ++i) {
+      waypoints_.push_back(waypoint);
+      heading += turn(engine_);
+      waypoint += Eigen::Vector3d(
+        config_.size * std::cos(heading), config_.size * std::sin(heading), climb(engine_));
+    }
+  }
+
+  void generate()
+  {
+    std::normal_distribution<double> normal(0.0, 1.0);
+    auto noise = [&](const double sigma) {
+        return Eigen::Vector3d(
+          sigma * normal(engine_), sigma * normal(engine_), sigma * normal(engine_));
+      };
+    const Eigen::Vector3d gravity(0, 0, 9.80665);
+    Eigen::Vector3d gyro_bias = noise(config_.gyro_bias);
+    Eigen::Vector3d acc_bias = noise(config_.acc_bias);
+
+    const size_t num_imu = static_cast<size_t>(config_.duration * config_.imu_rate);
+    ground_truth_.reserve(num_imu + 1);
+    ground_truth_.push_back(truth(0.0));
+    measurements_.reserve(
+      num_imu + static_cast<size_t>(config_.duration * (config_.gnss_rate + config_.odom_rate)) +
+      2);
+
+    // each stream on its own clock; the next sample of each is emitted in stamp order
+    size_t num_gnss = 1, num_odom = 1;
+    const double gnss_period = config_.gnss_rate > 0 ? 1.0 / config_.gnss_rate : 0.0;
+    const double odom_period = config_.odom_rate > 0 ? 1.0 / config_.odom_rate : 0.0;
+    State previous_odom_truth = ground_truth_.front();
+    Eigen::Isometry3d odom = toIsometry(previous_odom_truth);
+
+    for (size_t i = 1; i <= num_imu; ++i) {
+      const double stamp = i / config_.imu_rate;
+      const State state = truth(stamp);
+      ground_truth_.push_back(state);
+      gyro_bias += noise(config_.gyro_bias_walk);
+      acc_bias += noise(config_.acc_bias_walk);
+      Measurement imu;
+      imu.type = Measurement::IMU;
+      imu.stamp = stamp;
+      imu.first = state.angular_velocity + gyro_bias + noise(config_.gyro_noise);
+      imu.second = state.orientation.inverse() * (state.acceleration + gravity) + acc_bias +
+        noise(config_.acc_noise);
+      imu.orientation = Eigen::Quaterniond::Identity();
+      imu.truth_index = i;
+      measurements_.push_back(imu);
+
+      const double next_stamp = (i + 1) / config_.imu_rate;
+      while (gnss_period > 0 && num_gnss * gnss_period < next_stamp) {
+        const State gnss_state = truth(num_gnss * gnss_period);
+        Measurement gnss;
+        gnss.type = Measurement::GNSS;
+        gnss.stamp = gnss_state.stamp;
+        gnss.first = gnss_state.position + Eigen::Vector3d(
+          config_.gnss_noise_xy * normal(engine_), config_.gnss_noise_xy * normal(engine_),
+          config_.gnss_noise_z * normal(engine_));
+        gnss.second.setZero();
+        gnss.orientation = gnss_state.orientation;
+        gnss.truth_index = i;
+        measurements_.push_back(gnss);
+        ++num_gnss;
+      }
+      while (odom_period > 0 && num_odom * odom_period < next_stamp) {
+        const State odom_state = truth(num_odom * odom_period);
+        Eigen::Isometry3d increment =
+          toIsometry(previous_odom_truth).inverse() * toIsometry(odom_state);
+        increment.translation() =
+          (1 + config_.odom_scale_error) * increment.translation() + noise(config_.odom_noise);
+        odom = odom * increment;
+        Measurement measurement;
+        measurement.type = Measurement::ODOM;
+        measurement.stamp = odom_state.stamp;
+        measurement.first = odom.translation();
+        measurement.second.setZero();
+        measurement.orientation = Eigen::Quaterniond(odom.linear());
+        measurement.truth_index = i;
+        measurements_.push_back(measurement);
+        previous_odom_truth = odom_state;
+        ++num_odom;
+      }
+    }
+  }
+
+  static Eigen::Isometry3d toIsometry(const State & state)
+  {
+    Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+    pose.translation() = state.position;
+    pose.linear() = state.orientation.toRotationMatrix();
+    return pose;
+  }
+
+  const Config config_;
+  std::mt19937 engine_;
+  std::vector<Eigen::Vector3d> waypoints_;
+  std::vector<State> ground_truth_;
+  std::vector<Measurement> measurements_;
+};
+
+#endif  // KALMAN_FILTER_LOCALIZATION__SIMULATOR_HPP_
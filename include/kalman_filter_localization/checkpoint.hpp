@@ -0,0 +1,160 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef KALMAN_FILTER_LOCALIZATION__CHECKPOINT_HPP_
+#define KALMAN_FILTER_LOCALIZATION__CHECKPOINT_HPP_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace kalman_filter_localization
+{
+/*
+* Filter state saved to warm start after a restart.
+*
+* File layout: "KFLC", format version, payload size (uint32 each), the payload (this
+* struct as is) and an FNV-1a hash of the payload (uint64). Everything is in host byte
+* order, so a checkpoint is only read back on the same architecture.
+*/
+struct Checkpoint
+{
+  int64_t stamp_nanoseconds;  // of the newest sample in the state
+  double x[10];
+  double covariance[81];  // error state covariance, column major
+  // filter settings the state was estimated with
+  double var_imu_w;
+  double var_imu_acc;
+};
+static_assert(
+  std::is_trivially_copyable<Checkpoint>::value && std::is_standard_layout<Checkpoint>::value,
+  "Checkpoint is written as raw bytes");
+
+inline uint64_t checkpointHash(const Checkpoint & checkpoint)
+{
+  const unsigned char * bytes = reinterpret_cast<const unsigned char *>(&checkpoint);
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(Checkpoint); ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* flushes the entries of a directory (e.g. a rename in it) to the storage device */
+inline bool syncDirectory(const std::string & path)
+{
+#ifdef __linux__
+  const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+#else
+  (void)path;
+  return true;
+#endif
+}
+
+/*
+* written to path.tmp, synced and renamed over path (and the directory synced), so a
+* crash or power loss while writing leaves the previous checkpoint intact. Not safe to
+* call concurrently for the same path.
+*/
+inline bool saveCheckpoint(const std::string & path, const Checkpoint & checkpoint)
+{
+  const std::string tmp_path = path + ".tmp";
+  std::FILE * file = std::fopen(tmp_path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  const char magic[4] = {'K', 'F', 'L', 'C'};
+  const uint32_t header[2] = {1, sizeof(Checkpoint)};
+  const uint64_t hash = checkpointHash(checkpoint);
+  const bool written = std::fwrite(magic, sizeof(magic), 1, file) == 1 &&
+    std::fwrite(header, sizeof(header), 1, file) == 1 &&
+    std::fwrite(&checkpoint, sizeof(Checkpoint), 1, file) == 1 &&
+    std::fwrite(&hash, sizeof(hash), 1, file) == 1 &&
+    std::fflush(file) == 0;
+#ifdef __linux__
+  const bool synced = written && fsync(fileno(file)) == 0;
+#else
+  const bool synced = written;
+#endif
+  if (std::fclose(file) != 0 || !synced) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return false;
+  }
+  // the rename itself is only durable once the directory entry is
+  const size_t separator = path.find_last_of('/');
+  return syncDirectory(
+    separator == std::string::npos ? std::string(".") :
+    separator == 0 ? std::string("/") : path.substr(0, separator));
+}
+
+/* false if the file is missing, truncated, corrupt or of another format version */
+inline bool loadCheckpoint(const std::string & path, Checkpoint & checkpoint)
+{
+  std::FILE * file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  char magic[4];
+  uint32_t header[2];
+  uint64_t hash;
+  Checkpoint read;
+  const bool complete = std::fread(magic, sizeof(magic), 1, file) == 1 &&
+    std::memcmp(magic, "KFLC", 4) == 0 &&
+    std::fread(header, sizeof(header), 1, file) == 1 &&
+    header[0] == 1 && header[1] == sizeof(Checkpoint) &&
+    std::fread(&read, sizeof(Checkpoint), 1, file) == 1 &&
+    std::fread(&hash, sizeof(hash), 1, file) == 1;
+  std::fclose(file);
+  if (!complete || hash != checkpointHash(read)) {
+    return false;
+  }
+  checkpoint = read;
+  return true;
+}
+}  // namespace kalman_filter_localization
+
+#endif  // KALMAN_FILTER_LOCALIZATION__CHECKPOINT_HPP_
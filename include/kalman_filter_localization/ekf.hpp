@@ -32,18 +32,59 @@
 #ifndef KALMAN_FILTER_LOCALIZATION__EKF_HPP_
 #define KALMAN_FILTER_LOCALIZATION__EKF_HPP_
 
+#include <Eigen/Cholesky>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
-#include <iostream>
+#include <Eigen/QR>
+#include <Eigen/StdVector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <kalman_filter_localization/ring_buffer.hpp>
+#include <limits>
+#include <type_traits>
 
-class EKFEstimator
+/*
+* Scalar is the type of the state, the covariance and the sensor inputs.
+* Time stamps are always kept in double, since epoch seconds do not fit in float.
+*/
+template<typename Scalar_>
+class EKFEstimatorT
 {
 public:
-  EKFEstimator()
-  : P_(EigenMatrix9d::Identity() * 100), var_imu_w_{0.33}, var_imu_acc_{0.33}, tau_gyro_bias_{1.0}
+  typedef Scalar_ Scalar;
+
+  static const int num_state_{10};
+  static const int num_error_state_{9};
+  static const int num_noise_{6};
+  static const int num_observation_{3};
+
+  typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+  typedef Eigen::Matrix<Scalar, 3, 3> Matrix3;
+  typedef Eigen::Quaternion<Scalar> Quaternion;
+  typedef Eigen::Matrix<Scalar, num_state_, 1> StateVector;
+  typedef Eigen::Matrix<Scalar, num_error_state_, 1> ErrorStateVector;
+  typedef Eigen::Matrix<Scalar, num_error_state_, num_error_state_> EigenMatrix9d;
+
+  /*
+* DENSE keeps P itself.
+* SQUARE_ROOT keeps a lower triangular factor S with P = S S^T and updates it
+* with QR factorizations, so P stays symmetric positive semi-definite by construction.
+* P is then only reconstructed when getCoveriance() is called.
+*/
+  enum class CovarianceForm { DENSE, SQUARE_ROOT };
+
+  explicit EKFEstimatorT(const CovarianceForm covariance_form = CovarianceForm::DENSE)
+  : var_imu_w_{0.33},
+    var_imu_acc_{0.33},
+    covariance_form_{covariance_form},
+    P_(EigenMatrix9d::Identity() * 100),
+    S_(EigenMatrix9d::Identity() * 10),
+    tau_gyro_bias_{1.0}
   {
     /* x  = [p v q] = [x y z vx vy vz qx qy qz qw] */
     x_ << 0, 0, 0, 0, 0, 0, 0, 0, 0, 1;
+    preintegration_.reset();
   }
 
   /* state
@@ -52,145 +93,728 @@ public:
 *
 * pos_k = pos_{k-1} + vel_k * dt + (1/2) * (Rot(q_{k-1}) acc_{k-1}^{imu} - g) *dt^2
 * vel_k = vel_{k-1} + (Rot(quat_{k-1})) acc_{k-1}^{imu} - g) *dt
-* quat_k = Rot(w_{k-1}^{imu}*dt)*quat_{k-1}
+* quat_k = Exp(w_{k-1}^{imu}*dt)*quat_{k-1}
 *
 * covariance
 * P_{k} = F_k P_{k-1} F_k^T + L Q_k L^T
+* (block-wise unless KFL_EKF_DENSE_COVARIANCE_PROPAGATION is defined)
+*
+* With a preintegration batch size N > 1 the mean is still propagated every sample,
+* but F and L Q L^T are accumulated and P is propagated once per N samples
+* (or before the next observation update / getCoveriance(), whichever comes first).
+*
+* All intermediates are fixed-size, so this runs without heap allocation.
 */
   void predictionUpdate(
-    const double current_time_imu, const Eigen::Vector3d & gyro,
-    const Eigen::Vector3d & linear_acceleration)
+    const double current_time_imu, const Vector3 & gyro, const Vector3 & linear_acceleration)
   {
-    double dt_imu = current_time_imu - previous_time_imu_;
-    previous_time_imu_ = current_time_imu;
-    if (dt_imu > 0.5 /* [sec] */) {
-      std::cout << "imu time interval is too large" << std::endl;
-      return;
+    propagate(current_time_imu, gyro, linear_acceleration);
+    if (imu_history_.capacity() > 0) {
+      ImuSnapshot & snapshot = imu_history_.push_back();
+      snapshot.gyro = gyro;
+      snapshot.acc = linear_acceleration;
+      saveSnapshot(snapshot);
     }
+  }
+
+  /*
+* y = pobs = [xobs yobs zobs]
+*
+* K = P_k H^T (H P_k H^T + R)^{-1}
+*
+* dx = K (y_k - p_k )
+*
+* p_x = p_{k-1} + dp_k
+* v_k = v_{k-1} + dv_k
+* q_k = q_{k-1} Exp(dth)
+*
+* P_k = (I - KH)*P_{k-1}
+* or, in Joseph form,
+* P_k = (I - KH)*P_{k-1}*(I - KH)^T + K R K^T
+*
+* covariance is R, which takes the joint update above.
+*
+* The observation is taken at the time of the latest IMU sample.
+*/
+  void observationUpdate(const Vector3 & y, const Matrix3 & covariance)
+  {
+    observationUpdate(previous_time_imu_, y, covariance);
+  }
 
-    Eigen::Quaterniond quat_wdt = Eigen::Quaterniond(
-      Eigen::AngleAxisd(gyro.x() * dt_imu, Eigen::Vector3d::UnitX()) *
-      Eigen::AngleAxisd(gyro.y() * dt_imu, Eigen::Vector3d::UnitY()) *
-      Eigen::AngleAxisd(gyro.z() * dt_imu, Eigen::Vector3d::UnitZ()));
-    Eigen::Vector3d acc =
-      Eigen::Vector3d(linear_acceleration.x(), linear_acceleration.y(), linear_acceleration.z());
+  /*
+* same as above with a diagonal R = diag(variance). In DENSE form the three components
+* are then processed as sequential scalar updates (unless disabled by setSequentialUpdate),
+* which needs no matrix inverse and gives the same x and P as the joint update.
+*/
+  void observationUpdateDiagonal(const Vector3 & y, const Vector3 & variance)
+  {
+    observationUpdateDiagonal(previous_time_imu_, y, variance);
+  }
 
-    // state
-    Eigen::Quaterniond previous_quat =
-      Eigen::Quaterniond(x_(STATE::QW), x_(STATE::QX), x_(STATE::QY), x_(STATE::QZ));
-    Eigen::MatrixXd rot_mat = previous_quat.toRotationMatrix();
+  /*
+* observation taken at stamp.
+*
+* With a history (setHistoryCapacity), an observation older than the latest IMU sample is
+* applied at its own time: the filter is rewound to the last IMU snapshot at or before
+* stamp, and the stored IMU samples and observations after it are replayed, so the replay
+* costs at most one history length of predictions.
+* Returns false if the observation is older than the history and was dropped.
+*/
+  bool observationUpdate(const double stamp, const Vector3 & y, const Matrix3 & covariance)
+  {
+    return insertObservation(stamp, y, covariance, false);
+  }
+
+  bool observationUpdateDiagonal(const double stamp, const Vector3 & y, const Vector3 & variance)
+  {
+    const Matrix3 R = variance.asDiagonal();
+    return insertObservation(stamp, y, R, true);
+  }
+
+  void setTauGyroBias(const double tau_gyro_bias) { tau_gyro_bias_ = tau_gyro_bias; }
+
+  void setVarImuGyro(const double var_imu_w) { var_imu_w_ = var_imu_w; }
+
+  void setVarImuAcc(const double var_imu_acc) { var_imu_acc_ = var_imu_acc; }
+
+  /*
+* The Joseph form keeps P symmetric positive definite in low precision; on by default for float.
+* It applies to the joint update; the sequential update is a symmetric rank one downdate.
+*/
+  void setJosephForm(const bool joseph_form) { joseph_form_ = joseph_form; }
+
+  void setSequentialUpdate(const bool sequential_update) { sequential_update_ = sequential_update; }
+
+  /* number of IMU samples per covariance propagation; 1 propagates every sample */
+  void setPreintegrationBatchSize(const int batch_size)
+  {
+    flushPreintegration();
+    preintegration_batch_size_ = std::max(batch_size, 1);
+  }
+
+  /*
+* number of IMU samples (and observations) kept for out-of-sequence observations;
+* 0 disables the history. Allocates once here, not per sample.
+*/
+  void setHistoryCapacity(const size_t capacity)
+  {
+    imu_history_.reserve(capacity);
+    observation_history_.reserve(capacity);
+  }
+
+  void setInitialX(const StateVector & x)
+  {
+    x_ = x;
+    imu_history_.clear();
+    observation_history_.clear();
+  }
+
+  /*
+* e.g. to restore a checkpoint; P must be symmetric positive definite. Pending
+* preintegrated samples are dropped, P replaces them.
+* Returns false, and keeps the current covariance, if P has no Cholesky factorization.
+*/
+  bool setInitialCovariance(const EigenMatrix9d & P)
+  {
+    const Eigen::LLT<EigenMatrix9d> llt(P);
+    if (!P.allFinite() || llt.info() != Eigen::Success) {
+      return false;
+    }
+    preintegration_.reset();
+    P_ = P;
+    if (covariance_form_ == CovarianceForm::SQUARE_ROOT) {
+      S_ = llt.matrixL();
+      covariance_outdated_ = false;
+    }
+    imu_history_.clear();
+    observation_history_.clear();
+    return true;
+  }
+
+  const StateVector & getX() const { return x_; }
+
+  const EigenMatrix9d & getCoveriance()
+  {
+    flushPreintegration();
+    if (covariance_form_ == CovarianceForm::SQUARE_ROOT && covariance_outdated_) {
+      P_.noalias() = S_ * S_.transpose();
+      covariance_outdated_ = false;
+    }
+    return P_;
+  }
+
+  CovarianceForm getCovarianceForm() const { return covariance_form_; }
+
+  int getNumState() const { return num_state_; }
+
+  /* number of imu samples ignored because they followed a gap of more than 0.5 sec */
+  uint64_t getNumSkippedImuSamples() const { return num_skipped_imu_samples_; }
+
+  /*
+* rotation vector to quaternion
+*
+* Exp(th) = [cos(|th|/2), sin(|th|/2) th/|th|]
+*
+* Below |th| = 1e-2 (every gyro increment at IMU rates) cos(|th|/2) and sin(|th|/2)/|th|
+* are replaced by their Taylor series up to |th|^4, which needs no sin/cos or sqrt and is
+* exact to below double precision there.
+*/
+  static Quaternion quaternionExp(const Vector3 & theta)
+  {
+    const Scalar angle2 = theta.squaredNorm();
+    Scalar real;
+    Scalar imag_scale;
+    if (angle2 < Scalar(1e-4)) {
+      const Scalar angle4 = angle2 * angle2;
+      real = Scalar(1) - angle2 / Scalar(8) + angle4 / Scalar(384);
+      imag_scale = Scalar(0.5) - angle2 / Scalar(48) + angle4 / Scalar(3840);
+    } else {
+      const Scalar angle = std::sqrt(angle2);
+      real = std::cos(angle / 2);
+      imag_scale = std::sin(angle / 2) / angle;
+    }
+    return Quaternion(
+      real, imag_scale * theta.x(), imag_scale * theta.y(), imag_scale * theta.z());
+  }
+
+  /*
+* mean part of predictionUpdate, without touching the filter; e.g. to extrapolate a
+* copy of the state between IMU samples
+*/
+  static void predictMean(
+    StateVector & x, const Vector3 & gyro, const Vector3 & linear_acceleration, const Scalar dt)
+  {
+    const Matrix3 rot_mat =
+      Quaternion(x(STATE::QW), x(STATE::QX), x(STATE::QY), x(STATE::QZ)).toRotationMatrix();
+    predictMean(x, gyro, linear_acceleration, dt, rot_mat);
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+  /* rot_mat is Rot(q_{k-1}) */
+  static void predictMean(
+    StateVector & x, const Vector3 & gyro, const Vector3 & linear_acceleration, const Scalar dt,
+    const Matrix3 & rot_mat)
+  {
+    const Vector3 gravity(0, 0, Scalar(9.80665));
+    const Vector3 acc_world = rot_mat * linear_acceleration - gravity;
 
     // pos
-    x_.segment(STATE::X, 3) = x_.segment(STATE::X, 3) + dt_imu * x_.segment(STATE::VX, 3) +
-                              0.5 * dt_imu * dt_imu * (rot_mat * acc - gravity_);
+    x.template segment<3>(STATE::X) += dt * x.template segment<3>(STATE::VX) +
+      Scalar(0.5) * dt * dt * acc_world;
     // vel
-    x_.segment(STATE::VX, 3) = x_.segment(STATE::VX, 3) + dt_imu * (rot_mat * acc - gravity_);
+    x.template segment<3>(STATE::VX) += dt * acc_world;
     // quat
-    Eigen::Quaterniond predicted_quat = quat_wdt * previous_quat;
-    x_.segment(STATE::QX, 4) = Eigen::Vector4d(
-      predicted_quat.x(), predicted_quat.y(), predicted_quat.z(), predicted_quat.w());
-
-    // F
-    Eigen::MatrixXd F = EigenMatrix9d::Identity();
-    F.block<3, 3>(0, 3) = dt_imu * Eigen::Matrix3d::Identity();
-    Eigen::Matrix3d acc_skew;
+    const Quaternion previous_quat =
+      Quaternion(x(STATE::QW), x(STATE::QX), x(STATE::QY), x(STATE::QZ));
+    const Quaternion predicted_quat = quaternionExp(gyro * dt) * previous_quat;
+    x.template segment<4>(STATE::QX) = predicted_quat.normalized().coeffs();
+  }
+
+  /*
+* error state transition and noise accumulated over a batch of IMU samples
+*
+* Phi = F_n ... F_1 = [[I, dt*I, B], [0, I, C], [0, 0, I]]
+* Q = Phi_{n<-2} L Q_1 L^T Phi_{n<-2}^T + ... + L Q_n L^T, stored on its upper blocks
+*
+* Q_22 stays a multiple of I, which saves a product per sample over propagating P.
+*/
+  struct Preintegration
+  {
+    int count;
+    Scalar dt;
+    Matrix3 B;
+    Matrix3 C;
+    Matrix3 Q00;
+    Matrix3 Q01;
+    Matrix3 Q02;
+    Matrix3 Q11;
+    Matrix3 Q12;
+    Scalar q22;
+
+    void reset()
+    {
+      count = 0;
+      dt = 0;
+      B.setZero();
+      C.setZero();
+      Q00.setZero();
+      Q01.setZero();
+      Q02.setZero();
+      Q11.setZero();
+      Q12.setZero();
+      q22 = 0;
+    }
+
+    /* Phi <- F Phi, Q <- F Q F^T + L Q_k L^T with F = [[I, dt*I, 0], [0, I, A], [0, 0, I]] */
+    void integrate(const Scalar dt_k, const Matrix3 & A, const Scalar q_acc, const Scalar q_w)
+    {
+      const Matrix3 M00 = Q00 + dt_k * Q01.transpose();
+      const Matrix3 M01 = Q01 + dt_k * Q11;
+      const Matrix3 M02 = Q02 + dt_k * Q12;
+      const Matrix3 M11 = Q11 + A * Q12.transpose();
+      const Matrix3 M12 = Q12 + q22 * A;
+
+      Q00 = M00 + dt_k * M01;
+      Q01.noalias() = M01 + M02 * A.transpose();
+      Q02 = M02;
+      Q11.noalias() = M11 + M12 * A.transpose();
+      Q11.diagonal().array() += q_acc;
+      Q12 = M12;
+      q22 += q_w;
+
+      B += dt_k * C;
+      C += A;
+      dt += dt_k;
+      ++count;
+    }
+  };
+
+  void propagate(
+    const double current_time_imu, const Vector3 & gyro, const Vector3 & linear_acceleration)
+  {
+    const Scalar dt_imu = static_cast<Scalar>(current_time_imu - previous_time_imu_);
+    previous_time_imu_ = current_time_imu;
+    if (dt_imu > Scalar(0.5) /* [sec] */) {
+      // imu time interval is too large; counted instead of logged, see getNumSkippedImuSamples
+      ++num_skipped_imu_samples_;
+      return;
+    }
+
+    const Vector3 & acc = linear_acceleration;
+
+    // state
+    const Matrix3 rot_mat =
+      Quaternion(x_(STATE::QW), x_(STATE::QX), x_(STATE::QY), x_(STATE::QZ)).toRotationMatrix();
+    predictMean(x_, gyro, acc, dt_imu, rot_mat);
+
+    // F = [[I, dt*I, 0], [0, I, A], [0, 0, I]]
+    Matrix3 acc_skew;
     acc_skew << 0, -acc(2), acc(1), acc(2), 0, -acc(0), -acc(1), acc(0), 0;
-    F.block<3, 3>(3, 6) = rot_mat * (-acc_skew) * dt_imu;
+    const Matrix3 A = rot_mat * (-acc_skew) * dt_imu;
+
+    if (preintegration_batch_size_ > 1) {
+      const Scalar dt2 = dt_imu * dt_imu;
+      preintegration_.integrate(dt_imu, A, var_imu_acc_ * dt2, var_imu_w_ * dt2);
+      if (preintegration_.count >= preintegration_batch_size_) {
+        flushPreintegration();
+      }
+      return;
+    }
+
+    if (covariance_form_ == CovarianceForm::SQUARE_ROOT) {
+      propagateCovarianceFactor(dt_imu, A);
+      return;
+    }
+
+#ifdef KFL_EKF_DENSE_COVARIANCE_PROPAGATION
+    EigenMatrix9d F = EigenMatrix9d::Identity();
+    F.template block<3, 3>(0, 3) = dt_imu * Matrix3::Identity();
+    F.template block<3, 3>(3, 6) = A;
 
     // Q
-    Eigen::MatrixXd Q = Eigen::Matrix<double, 6, 6>::Identity();
-    Q.block<3, 3>(0, 0) = var_imu_acc_ * Q.block<3, 3>(0, 0);
-    Q.block<3, 3>(3, 3) = var_imu_w_ * Q.block<3, 3>(3, 3);
+    Eigen::Matrix<Scalar, num_noise_, num_noise_> Q =
+      Eigen::Matrix<Scalar, num_noise_, num_noise_>::Identity();
+    Q.template block<3, 3>(0, 0) = var_imu_acc_ * Q.template block<3, 3>(0, 0);
+    Q.template block<3, 3>(3, 3) = var_imu_w_ * Q.template block<3, 3>(3, 3);
     Q = Q * (dt_imu * dt_imu);
 
     // L
-    Eigen::MatrixXd L = Eigen::Matrix<double, num_error_state_, 6>::Zero();
-    L.block<3, 3>(3, 0) = Eigen::Matrix3d::Identity();
-    L.block<3, 3>(6, 3) = Eigen::Matrix3d::Identity();
+    Eigen::Matrix<Scalar, num_error_state_, num_noise_> L =
+      Eigen::Matrix<Scalar, num_error_state_, num_noise_>::Zero();
+    L.template block<3, 3>(3, 0) = Matrix3::Identity();
+    L.template block<3, 3>(6, 3) = Matrix3::Identity();
 
     P_ = F * P_ * F.transpose() + L * Q * L.transpose();
+#else
+    propagateCovariance(dt_imu, A);
+#endif
+  }
+
+  struct ImuSnapshot
+  {
+    double stamp;
+    Vector3 gyro;
+    Vector3 acc;
+    // filter state right after the prediction with this sample
+    StateVector x;
+    EigenMatrix9d covariance;  // P_, or S_ in SQUARE_ROOT form
+    bool covariance_outdated;
+    Preintegration preintegration;
+  };
+
+  struct ObservationRecord
+  {
+    double stamp;
+    Vector3 y;
+    Matrix3 covariance;
+    bool diagonal;
+  };
+
+  void saveSnapshot(ImuSnapshot & snapshot) const
+  {
+    snapshot.stamp = previous_time_imu_;
+    snapshot.x = x_;
+    snapshot.covariance = (covariance_form_ == CovarianceForm::SQUARE_ROOT) ? S_ : P_;
+    snapshot.covariance_outdated = covariance_outdated_;
+    snapshot.preintegration = preintegration_;
+  }
+
+  void restoreSnapshot(const ImuSnapshot & snapshot)
+  {
+    previous_time_imu_ = snapshot.stamp;
+    x_ = snapshot.x;
+    if (covariance_form_ == CovarianceForm::SQUARE_ROOT) {
+      S_ = snapshot.covariance;
+    } else {
+      P_ = snapshot.covariance;
+    }
+    covariance_outdated_ = snapshot.covariance_outdated;
+    preintegration_ = snapshot.preintegration;
+  }
+
+  bool insertObservation(
+    const double stamp, const Vector3 & y, const Matrix3 & covariance, const bool diagonal)
+  {
+    const ObservationRecord observation{stamp, y, covariance, diagonal};
+    if (imu_history_.empty() || stamp >= imu_history_.back().stamp) {
+      applyObservation(observation);
+      if (observation_history_.capacity() > 0) {
+        size_t i = observation_history_.size();
+        while (i > 0 && observation_history_[i - 1].stamp > stamp) {
+          --i;
+        }
+        observation_history_.insert(i, observation);
+      }
+      return true;
+    }
+    if (stamp < imu_history_.front().stamp) {
+      return false;
+    }
+
+    // rewind to the last IMU sample at or before stamp
+    size_t restore_index = imu_history_.size() - 1;
+    while (imu_history_[restore_index].stamp > stamp) {
+      --restore_index;
+    }
+    const double restore_stamp = imu_history_[restore_index].stamp;
+
+    size_t i = observation_history_.size();
+    while (i > 0 && observation_history_[i - 1].stamp > stamp) {
+      --i;
+    }
+    if (!observation_history_.insert(i, observation)) {
+      return false;
+    }
+    size_t next_observation = observation_history_.size();
+    while (next_observation > 0 &&
+      observation_history_[next_observation - 1].stamp >= restore_stamp)
+    {
+      --next_observation;
+    }
+
+    // replay the IMU samples and the observations between them in stamp order
+    restoreSnapshot(imu_history_[restore_index]);
+    for (size_t k = restore_index; k < imu_history_.size(); ++k) {
+      ImuSnapshot & snapshot = imu_history_[k];
+      if (k > restore_index) {
+        propagate(snapshot.stamp, snapshot.gyro, snapshot.acc);
+        saveSnapshot(snapshot);
+      }
+      const double next_stamp = (k + 1 < imu_history_.size()) ?
+        imu_history_[k + 1].stamp : std::numeric_limits<double>::infinity();
+      while (next_observation < observation_history_.size() &&
+        observation_history_[next_observation].stamp < next_stamp)
+      {
+        applyObservation(observation_history_[next_observation]);
+        ++next_observation;
+      }
+    }
+    return true;
+  }
+
+  void applyObservation(const ObservationRecord & observation)
+  {
+    flushPreintegration();
+    const Vector3 innovation = observation.y - x_.template segment<3>(STATE::X);
+    ErrorStateVector dx;
+    if (covariance_form_ == CovarianceForm::SQUARE_ROOT) {
+      const Matrix3 sqrt_R = observation.diagonal ?
+        Matrix3(observation.covariance.diagonal().cwiseSqrt().asDiagonal()) :
+        Matrix3(observation.covariance.llt().matrixL());
+      dx = updateCovarianceFactor(innovation, sqrt_R);
+    } else if (observation.diagonal && sequential_update_) {
+      dx = updateCovarianceSequentially(innovation, observation.covariance.diagonal());
+    } else {
+      dx = updateCovariance(innovation, observation.covariance);
+    }
+    injectErrorState(dx);
+  }
+
+  void flushPreintegration()
+  {
+    if (preintegration_.count == 0) {
+      return;
+    }
+    if (covariance_form_ == CovarianceForm::SQUARE_ROOT) {
+      propagateCovarianceFactor(preintegration_);
+    } else {
+      propagateCovariance(preintegration_);
+    }
+    preintegration_.reset();
+  }
+
+  /* H = [I 0 0], so P H^T and H P H^T are just the first columns and the top left block of P */
+  ErrorStateVector updateCovariance(const Vector3 & innovation, const Matrix3 & R)
+  {
+    const Eigen::Matrix<Scalar, num_error_state_, num_observation_> PHt =
+      P_.template leftCols<num_observation_>();
+    const Matrix3 S = PHt.template topRows<num_observation_>() + R;
+    const Eigen::Matrix<Scalar, num_error_state_, num_observation_> K = PHt * S.inverse();
+
+    if (joseph_form_) {
+      // H P = (P H^T)^T, and K S K^T = P H^T K^T in exact arithmetic
+      const EigenMatrix9d KHP = K * PHt.transpose();
+      P_ = P_ - KHP - KHP.transpose() + K * S * K.transpose();
+    } else {
+      P_ = P_ - K * PHt.transpose();
+    }
+    P_ = (Scalar(0.5) * (P_ + P_.transpose())).eval();
+
+    return K * innovation;
   }
 
   /*
-* y = pobs = [xobs yobs zobs]
-*
-* K = P_k H^T (H P_k H^T + R)^{-1}
+* diagonal R: one scalar update per observed component i, with h_i = e_i^T
 *
-* dx = K (y_k - p_k )
+* s = P_ii + r_i, k = P e_i / s
+* dx += k (y_i - p_i - dx_i)
+* P -= P e_i e_i^T P / s
+*/
+  ErrorStateVector updateCovarianceSequentially(
+    const Vector3 & innovation, const Vector3 & variance)
+  {
+    ErrorStateVector dx = ErrorStateVector::Zero();
+    for (int i = 0; i < num_observation_; ++i) {
+      const Scalar s = P_(i, i) + variance(i);
+      const ErrorStateVector c = P_.col(i) / std::sqrt(s);
+      dx += c * ((innovation(i) - dx(i)) / std::sqrt(s));
+      // c c^T is symmetric bit for bit, so P_ needs no symmetrization
+      P_.noalias() -= c * c.transpose();
+    }
+    return dx;
+  }
+
+  /*
+* square root form, with sqrt(R) sqrt(R)^T = R
 *
-* p_x = p_{k-1} + dp_k
-* v_k = v_{k-1} + dv_k
-* q_k = Rot(dth) q_{k-1}
+* [ sqrt(R)  H S ]             [ sqrt(H P H^T + R)   0   ]
+* [   0       S  ] * Theta  =  [ P H^T sqrt(.)^{-T}  S_k ]
 *
-* P_k = (I - KH)*P_{k-1}
+* Theta is the orthogonal factor of a QR decomposition of the transposed pre-array.
+* K = P H^T sqrt(.)^{-T} sqrt(.)^{-1}, so dx = L21 L11^{-1} (y_k - p_k)
 */
-  void observationUpdate(const Eigen::Vector3d & y, const Eigen::Vector3d & variance)
+  ErrorStateVector updateCovarianceFactor(const Vector3 & innovation, const Matrix3 & sqrt_R)
   {
-    // error state
-    Eigen::Matrix3d R;
-    R << variance.x(), 0, 0, 0, variance.y(), 0, 0, 0, variance.z();
-    Eigen::MatrixXd H = Eigen::Matrix<double, 3, num_error_state_>::Zero();
-    H.block<3, 3>(0, 0) = Eigen::Matrix3d::Identity();
-    Eigen::MatrixXd K = P_ * H.transpose() * (H * P_ * H.transpose() + R).inverse();
-    Eigen::VectorXd dx = K * (y - x_.segment(STATE::X, 3));
+    const int m = num_observation_;
+    const int n = num_error_state_;
+    Eigen::Matrix<Scalar, m + n, m + n> pre_array_t = Eigen::Matrix<Scalar, m + n, m + n>::Zero();
+    pre_array_t.template topLeftCorner<m, m>() = sqrt_R.transpose();
+    pre_array_t.template bottomLeftCorner<n, m>() = S_.template topRows<m>().transpose();
+    pre_array_t.template bottomRightCorner<n, n>() = S_.transpose();
 
+    const Eigen::HouseholderQR<Eigen::Matrix<Scalar, m + n, m + n>> qr(pre_array_t);
+    const Eigen::Matrix<Scalar, m + n, m + n> post_array =
+      qr.matrixQR().template triangularView<Eigen::Upper>().transpose();
+
+    const Matrix3 L11 = post_array.template topLeftCorner<m, m>();
+    const Vector3 normalized_innovation =
+      L11.template triangularView<Eigen::Lower>().solve(innovation);
+    S_ = post_array.template bottomRightCorner<n, n>();
+    covariance_outdated_ = true;
+
+    return post_array.template bottomLeftCorner<n, m>() * normalized_innovation;
+  }
+
+  void injectErrorState(const ErrorStateVector & dx)
+  {
     // state
-    x_.segment(STATE::X, 3) = x_.segment(STATE::X, 3) + dx.segment(ERROR_STATE::DX, 3);
-    x_.segment(STATE::VX, 3) = x_.segment(STATE::VX, 3) + dx.segment(ERROR_STATE::DVX, 3);
-    double norm_quat = sqrt(
-      pow(dx(ERROR_STATE::DTHX), 2) + pow(dx(ERROR_STATE::DTHY), 2) +
-      pow(dx(ERROR_STATE::DTHZ), 2));
-
-    if (norm_quat < 1e-10) {
-      Eigen::Quaterniond dq = Eigen::Quaterniond(cos(norm_quat / 2), 0, 0, 0);
-      Eigen::Quaterniond q =
-        Eigen::Quaterniond(x_(STATE::QW), x_(STATE::QX), x_(STATE::QY), x_(STATE::QZ));
-      Eigen::Quaterniond q_new = q * dq;
-      x_.segment(STATE::QX, 4) = Eigen::Vector4d(q_new.x(), q_new.y(), q_new.z(), q_new.w());
-    } else {
-      Eigen::Quaterniond dq = Eigen::Quaterniond(
-        cos(norm_quat / 2), sin(norm_quat / 2) * dx(ERROR_STATE::DTHX) / norm_quat,
-        sin(norm_quat / 2) * dx(ERROR_STATE::DTHY) / norm_quat,
-        sin(norm_quat / 2) * dx(ERROR_STATE::DTHZ) / norm_quat);
-      Eigen::Quaterniond q =
-        Eigen::Quaterniond(x_(STATE::QW), x_(STATE::QX), x_(STATE::QY), x_(STATE::QZ));
-      Eigen::Quaterniond q_new = q * dq;
-      x_.segment(STATE::QX, 4) = Eigen::Vector4d(q_new.x(), q_new.y(), q_new.z(), q_new.w());
-    }
+    x_.template segment<3>(STATE::X) += dx.template segment<3>(ERROR_STATE::DX);
+    x_.template segment<3>(STATE::VX) += dx.template segment<3>(ERROR_STATE::DVX);
+    Quaternion dq = quaternionExp(dx.template segment<3>(ERROR_STATE::DTHX));
+    Quaternion q = Quaternion(x_(STATE::QW), x_(STATE::QX), x_(STATE::QY), x_(STATE::QZ));
+    Quaternion q_new = q * dq;
+    x_.template segment<4>(STATE::QX) = q_new.normalized().coeffs();
+  }
+
+  /*
+* P_{k} = F_k P_{k-1} F_k^T + L Q_k L^T, evaluated on 3x3 blocks P_ij
+*
+* F = I + dt*E_01 + A*E_12, so with M = F P
+* M_0j = P_0j + dt*P_1j, M_1j = P_1j + A*P_2j, M_2j = P_2j
+* and with N = M F^T
+* N_i0 = M_i0 + dt*M_i1, N_i1 = M_i1 + M_i2*A^T, N_i2 = M_i2
+*
+* L Q L^T only adds var*dt^2*I to the dv and dth diagonal blocks.
+* Only the upper blocks are computed; the lower ones are mirrored.
+*/
+  void propagateCovariance(const Scalar dt, const Matrix3 & A)
+  {
+    const Matrix3 P00 = P_.template block<3, 3>(0, 0);
+    const Matrix3 P01 = P_.template block<3, 3>(0, 3);
+    const Matrix3 P02 = P_.template block<3, 3>(0, 6);
+    const Matrix3 P11 = P_.template block<3, 3>(3, 3);
+    const Matrix3 P12 = P_.template block<3, 3>(3, 6);
+    const Matrix3 P22 = P_.template block<3, 3>(6, 6);
 
-    P_ = (EigenMatrix9d::Identity() - K * H) * P_;
+    const Matrix3 M00 = P00 + dt * P01.transpose();
+    const Matrix3 M01 = P01 + dt * P11;
+    const Matrix3 M02 = P02 + dt * P12;
+    const Matrix3 M11 = P11 + A * P12.transpose();
+    const Matrix3 M12 = P12 + A * P22;
+
+    P_.template block<3, 3>(0, 0) = M00 + dt * M01;
+    P_.template block<3, 3>(0, 3).noalias() = M01 + M02 * A.transpose();
+    P_.template block<3, 3>(0, 6) = M02;
+    P_.template block<3, 3>(3, 3).noalias() = M11 + M12 * A.transpose();
+    P_.template block<3, 3>(3, 6) = M12;
+
+    const Scalar dt2 = dt * dt;
+    P_.template block<3, 3>(3, 3).diagonal().array() += var_imu_acc_ * dt2;
+    P_.template block<3, 3>(6, 6).diagonal().array() += var_imu_w_ * dt2;
+
+    P_.template block<3, 3>(3, 0) = P_.template block<3, 3>(0, 3).transpose();
+    P_.template block<3, 3>(6, 0) = P_.template block<3, 3>(0, 6).transpose();
+    P_.template block<3, 3>(6, 3) = P_.template block<3, 3>(3, 6).transpose();
+    // the new P_00 and P_11 are symmetric in exact arithmetic; drop the rounding asymmetry
+    symmetrizeBlock(0);
+    symmetrizeBlock(3);
   }
 
-  void setTauGyroBias(const double tau_gyro_bias) { tau_gyro_bias_ = tau_gyro_bias; }
+  /*
+* square root form of P_{k} = F_k P_{k-1} F_k^T + L Q_k L^T
+*
+* [F S, L sqrt(Q)]^T = Theta [S_k, 0]^T, so S_k is the transposed R factor of a QR
+* decomposition of the stacked (F S)^T and (L sqrt(Q))^T. F S is formed on row blocks.
+*/
+  void propagateCovarianceFactor(const Scalar dt, const Matrix3 & A)
+  {
+    const int n = num_error_state_;
+    Eigen::Matrix<Scalar, n + num_noise_, n> pre_array_t =
+      Eigen::Matrix<Scalar, n + num_noise_, n>::Zero();
+    pre_array_t.template block<n, 3>(0, 0) =
+      (S_.template middleRows<3>(0) + dt * S_.template middleRows<3>(3)).transpose();
+    pre_array_t.template block<n, 3>(0, 3) =
+      (S_.template middleRows<3>(3) + A * S_.template middleRows<3>(6)).transpose();
+    pre_array_t.template block<n, 3>(0, 6) = S_.template middleRows<3>(6).transpose();
+    pre_array_t.template block<3, 3>(n, 3).diagonal().setConstant(std::sqrt(var_imu_acc_) * dt);
+    pre_array_t.template block<3, 3>(n + 3, 6).diagonal().setConstant(std::sqrt(var_imu_w_) * dt);
 
-  void setVarImuGyro(const double var_imu_w) { var_imu_w_ = var_imu_w; }
+    const Eigen::HouseholderQR<Eigen::Matrix<Scalar, n + num_noise_, n>> qr(pre_array_t);
+    S_ = qr.matrixQR().template topRows<n>().template triangularView<Eigen::Upper>().transpose();
+    covariance_outdated_ = true;
+  }
 
-  void setVarImuAcc(const double var_imu_acc) { var_imu_acc_ = var_imu_acc; }
+  /*
+* P_{k} = Phi P_{k-1} Phi^T + Q for a preintegrated batch, on 3x3 blocks as above
+*
+* M_0j = P_0j + dt*P_1j + B*P_2j, M_1j = P_1j + C*P_2j, M_2j = P_2j
+* N_i0 = M_i0 + dt*M_i1 + M_i2*B^T, N_i1 = M_i1 + M_i2*C^T, N_i2 = M_i2
+*/
+  void propagateCovariance(const Preintegration & preintegration)
+  {
+    const Scalar dt = preintegration.dt;
+    const Matrix3 & B = preintegration.B;
+    const Matrix3 & C = preintegration.C;
+    const Matrix3 P01 = P_.template block<3, 3>(0, 3);
+    const Matrix3 P02 = P_.template block<3, 3>(0, 6);
+    const Matrix3 P11 = P_.template block<3, 3>(3, 3);
+    const Matrix3 P12 = P_.template block<3, 3>(3, 6);
+    const Matrix3 P22 = P_.template block<3, 3>(6, 6);
 
-  void setInitialX(Eigen::VectorXd x) { x_ = x; }
+    const Matrix3 M00 =
+      P_.template block<3, 3>(0, 0) + dt * P01.transpose() + B * P02.transpose();
+    const Matrix3 M01 = P01 + dt * P11 + B * P12.transpose();
+    const Matrix3 M02 = P02 + dt * P12 + B * P22;
+    const Matrix3 M11 = P11 + C * P12.transpose();
+    const Matrix3 M12 = P12 + C * P22;
 
-  Eigen::VectorXd getX() { return x_; }
+    P_.template block<3, 3>(0, 0) = M00 + dt * M01 + M02 * B.transpose() + preintegration.Q00;
+    P_.template block<3, 3>(0, 3) = M01 + M02 * C.transpose() + preintegration.Q01;
+    P_.template block<3, 3>(0, 6) = M02 + preintegration.Q02;
+    P_.template block<3, 3>(3, 3) = M11 + M12 * C.transpose() + preintegration.Q11;
+    P_.template block<3, 3>(3, 6) = M12 + preintegration.Q12;
+    P_.template block<3, 3>(6, 6).diagonal().array() += preintegration.q22;
 
-  Eigen::MatrixXd getCoveriance() { return P_; }
+    P_.template block<3, 3>(3, 0) = P_.template block<3, 3>(0, 3).transpose();
+    P_.template block<3, 3>(6, 0) = P_.template block<3, 3>(0, 6).transpose();
+    P_.template block<3, 3>(6, 3) = P_.template block<3, 3>(3, 6).transpose();
+    symmetrizeBlock(0);
+    symmetrizeBlock(3);
+  }
 
-  int getNumState() { return num_state_; }
+  /*
+* square root form of the batch propagation: triangularize [Phi S, sqrt(Q)]^T,
+* where sqrt(Q) comes from a pivoted LDL^T, since Q is only positive semi-definite
+*/
+  void propagateCovarianceFactor(const Preintegration & preintegration)
+  {
+    const int n = num_error_state_;
+    EigenMatrix9d Q;
+    Q.template block<3, 3>(0, 0) = preintegration.Q00;
+    Q.template block<3, 3>(0, 3) = preintegration.Q01;
+    Q.template block<3, 3>(0, 6) = preintegration.Q02;
+    Q.template block<3, 3>(3, 3) = preintegration.Q11;
+    Q.template block<3, 3>(3, 6) = preintegration.Q12;
+    Q.template block<3, 3>(6, 6) = preintegration.q22 * Matrix3::Identity();
+    Q.template block<3, 3>(3, 0) = preintegration.Q01.transpose();
+    Q.template block<3, 3>(6, 0) = preintegration.Q02.transpose();
+    Q.template block<3, 3>(6, 3) = preintegration.Q12.transpose();
+    const Eigen::LDLT<EigenMatrix9d> ldlt(Q);
+    EigenMatrix9d LD = ldlt.matrixL();
+    LD = LD * ldlt.vectorD().cwiseMax(Scalar(0)).cwiseSqrt().asDiagonal();
+    const EigenMatrix9d sqrt_Q = ldlt.transpositionsP().transpose() * LD;
 
-private:
-  double previous_time_imu_;
-  double var_imu_w_;
-  double var_imu_acc_;
+    Eigen::Matrix<Scalar, 2 * n, n> pre_array_t;
+    pre_array_t.template block<n, 3>(0, 0) =
+      (S_.template middleRows<3>(0) + preintegration.dt * S_.template middleRows<3>(3) +
+      preintegration.B * S_.template middleRows<3>(6)).transpose();
+    pre_array_t.template block<n, 3>(0, 3) =
+      (S_.template middleRows<3>(3) + preintegration.C * S_.template middleRows<3>(6)).transpose();
+    pre_array_t.template block<n, 3>(0, 6) = S_.template middleRows<3>(6).transpose();
+    pre_array_t.template bottomRows<n>() = sqrt_Q.transpose();
 
-  static const int num_state_{10};
-  static const int num_error_state_{9};
+    const Eigen::HouseholderQR<Eigen::Matrix<Scalar, 2 * n, n>> qr(pre_array_t);
+    S_ = qr.matrixQR().template topRows<n>().template triangularView<Eigen::Upper>().transpose();
+    covariance_outdated_ = true;
+  }
 
-  typedef Eigen::Matrix<double, num_error_state_, num_error_state_> EigenMatrix9d;
+  void symmetrizeBlock(const int i)
+  {
+    const Matrix3 block = P_.template block<3, 3>(i, i);
+    P_.template block<3, 3>(i, i) = Scalar(0.5) * (block + block.transpose());
+  }
 
-  Eigen::Matrix<double, num_state_, 1> x_;
-  EigenMatrix9d P_;
+  double previous_time_imu_{0.0};
+  uint64_t num_skipped_imu_samples_{0};
+  Scalar var_imu_w_;
+  Scalar var_imu_acc_;
+  bool joseph_form_{!std::is_same<Scalar, double>::value};
+  bool sequential_update_{true};
+  int preintegration_batch_size_{1};
+  Preintegration preintegration_;
+  RingBuffer<ImuSnapshot, Eigen::aligned_allocator<ImuSnapshot>> imu_history_;
+  RingBuffer<ObservationRecord, Eigen::aligned_allocator<ObservationRecord>> observation_history_;
+  CovarianceForm covariance_form_;
 
-  const Eigen::Vector3d gravity_{0, 0, 9.80665};
+  StateVector x_;
+  // in SQUARE_ROOT form P_ is a cache of S_ S_^T
+  EigenMatrix9d P_;
+  bool covariance_outdated_{false};
+  EigenMatrix9d S_;
 
-  double tau_gyro_bias_;
+  Scalar tau_gyro_bias_;
 
   enum STATE {
     X = 0,
@@ -217,4 +841,7 @@ private:
   };
 };
 
+typedef EKFEstimatorT<double> EKFEstimator;
+typedef EKFEstimatorT<float> EKFEstimatorf;
+
 #endif  // KALMAN_FILTER_LOCALIZATION__EKF_HPP_
@@ -75,42 +75,104 @@ extern "C" {
 #include <tf2/convert.h>
 #include <tf2/transform_datatypes.h>
 #include <tf2_ros/buffer.h>
-#include <tf2_ros/transform_broadcaster.h>
+#include <tf2_ros/qos.hpp>
 #include <tf2_ros/transform_listener.h>
 
+#include <builtin_interfaces/msg/time.hpp>
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
 #include <geometry_msgs/msg/pose_stamped.hpp>
+#include <geometry_msgs/msg/pose_with_covariance_stamped.hpp>
 #include <geometry_msgs/msg/transform.hpp>
 #include <geometry_msgs/msg/transform_stamped.hpp>
 #include <geometry_msgs/msg/vector3_stamped.hpp>
+#include <kalman_filter_localization/checkpoint.hpp>
 #include <kalman_filter_localization/ekf.hpp>
+#include <kalman_filter_localization/fusion_queue.hpp>
+#include <kalman_filter_localization/latency_histogram.hpp>
+#include <kalman_filter_localization/local_cartesian.hpp>
+#include <kalman_filter_localization/realtime.hpp>
+#include <kalman_filter_localization/seqlock.hpp>
+#include <kalman_filter_localization/tracing.hpp>
 #include <nav_msgs/msg/odometry.hpp>
 #include <rclcpp/rclcpp.hpp>
+#include <rclcpp_lifecycle/lifecycle_node.hpp>
+#include <rclcpp_lifecycle/lifecycle_publisher.hpp>
 #include <sensor_msgs/msg/imu.hpp>
+#include <sensor_msgs/msg/nav_sat_fix.hpp>
+#include <std_msgs/msg/float64.hpp>
 #include <tf2_eigen/tf2_eigen.hpp>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.hpp>
+#include <tf2_msgs/msg/tf_message.hpp>
 // #include <tf2_sensor_msgs/tf2_sensor_msgs.h>
 
 #include <Eigen/Core>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <rclcpp_components/register_node_macro.hpp>
 #include <string>
+#include <vector>
 
 namespace kalman_filter_localization
 {
-class EkfLocalizationComponent : public rclcpp::Node
+/*
+* Lifecycle node: parameters are read and the filter, publishers and subscriptions are set
+* up on configure; the filter runs and publishes only while active. Activation restores the
+* checkpoint (if checkpoint_path is set and the checkpoint is recent enough), which is
+* written every checkpoint_period while active and on deactivation.
+*/
+class EkfLocalizationComponent : public rclcpp_lifecycle::LifecycleNode
 {
 public:
+  typedef rclcpp_lifecycle::node_interfaces::LifecycleNodeInterface::CallbackReturn
+    CallbackReturn;
+
   KFL_EKFL_PUBLIC
   explicit EkfLocalizationComponent(const rclcpp::NodeOptions & options);
 
+  KFL_EKFL_PUBLIC
+  CallbackReturn on_configure(const rclcpp_lifecycle::State &) override;
+  KFL_EKFL_PUBLIC
+  CallbackReturn on_activate(const rclcpp_lifecycle::State &) override;
+  KFL_EKFL_PUBLIC
+  CallbackReturn on_deactivate(const rclcpp_lifecycle::State &) override;
+  KFL_EKFL_PUBLIC
+  CallbackReturn on_cleanup(const rclcpp_lifecycle::State &) override;
+  KFL_EKFL_PUBLIC
+  CallbackReturn on_shutdown(const rclcpp_lifecycle::State & state) override;
+
+  /* applies thread_priority and cpu_affinity to the calling (executor) thread */
+  KFL_EKFL_PUBLIC
+  void configureExecutorThread();
+
 private:
+  // drives the subscriptions directly to check the steady state for allocations
+  friend class EkfLocalizationComponentTest;
+
   std::string reference_frame_id_;
   std::string robot_frame_id_;
   std::string initial_pose_topic_;
   std::string imu_topic_;
   std::string odom_topic_;
   std::string gnss_pose_topic_;
+  std::string navsat_fix_topic_;
   int pub_period_;
+  std::string publish_mode_;
+  int publish_imu_decimation_;
+  bool publish_latency_;
+  bool extrapolate_to_publish_time_;
+  double max_extrapolation_horizon_;
+  bool publish_on_event_{false};
+  int imu_count_since_publish_{0};
+  // event mode: set under filter_mutex_ by a filter step and published by enqueue once the
+  // lock is released; the steps drained by one enqueue publish the latest state once
+  bool publish_pending_{false};
+  // serializes broadcastPose and its preallocated messages
+  std::mutex output_mutex_;
 
   double var_imu_w_;
   double var_imu_acc_;
@@ -119,35 +181,214 @@ private:
   Eigen::Vector3d var_gnss_;
   double var_odom_xyz_;
   Eigen::Vector3d var_odom_;
-  bool use_gnss_;
-  bool use_odom_;
+  // read by the sensor callbacks, changed by onSetParameters
+  std::atomic<bool> use_gnss_;
+  std::atomic<bool> use_odom_;
   bool use_gnss_as_initial_pose_;
+  bool use_navsat_fix_;
+  std::vector<double> navsat_origin_;
   bool broadcast_tf_topic_;
+  bool use_square_root_filter_;
+  int preintegration_batch_size_;
+  int history_capacity_;
+  bool use_static_imu_extrinsic_;
+  bool real_time_mode_;
+  int thread_priority_;
+  std::vector<int64_t> cpu_affinity_;
+  int fusion_queue_capacity_;
+  double fusion_reorder_window_;
+  bool publish_diagnostics_;
+  std::string checkpoint_path_;
+  double checkpoint_period_;
+  double max_checkpoint_age_;
+  int64_t last_checkpoint_stamp_{0};
+  // serializes writeCheckpoint
+  std::mutex checkpoint_mutex_;
+  std::atomic<bool> activated_{false};
 
-  geometry_msgs::msg::PoseStamped current_pose_;
   rclcpp::Time current_stamp_;
 
-  EKFEstimator ekf_;
+#ifdef KFL_EKF_USE_FLOAT
+  typedef EKFEstimatorf Estimator;
+#else
+  typedef EKFEstimator Estimator;
+#endif
+  Estimator ekf_;
+  // guards ekf_, fusion_queue_, current_stamp_, the last imu stamp and rates, initial_pose_
+  // and the noise variances
+  std::mutex filter_mutex_;
+  int64_t last_imu_stamp_nanoseconds_{0};
+  Eigen::Vector3d last_gyro_{Eigen::Vector3d::Zero()};
+  Eigen::Vector3d last_linear_acceleration_{Eigen::Vector3d::Zero()};
+  std::atomic<bool> initialized_{false};
+
+  // filter output handed to the output path without taking filter_mutex_
+  struct StateSnapshot
+  {
+    int64_t stamp_nanoseconds;
+    // of the last imu sample, which the state is propagated to
+    int64_t imu_stamp_nanoseconds;
+    double x[10];
+    // rates of the last imu sample, in robot_frame_id
+    double gyro[3];
+    double linear_acceleration[3];
+    double var_imu_w;
+    // error state covariance (column major), only filled while store_covariance_ is set
+    bool has_covariance;
+    double covariance[81];
+  };
+  SeqLock<StateSnapshot> state_snapshot_;
+
+  // imu sample (first: gyro, second: linear acceleration) or gnss/odom position
+  // (first: position) waiting in fusion_queue_
+  struct FusionItem
+  {
+    // NAVSAT_FIX: gnss position with its own covariance,
+    // NAVSAT_FIX_DIAGONAL: with its own variances (second)
+    enum Type { IMU, GNSS, ODOM, NAVSAT_FIX, NAVSAT_FIX_DIAGONAL } type;
+    builtin_interfaces::msg::Time stamp;
+    Eigen::Vector3d first;
+    Eigen::Vector3d second;
+    // only set for NAVSAT_FIX
+    Eigen::Matrix3d covariance;
+  };
+  FusionQueue<FusionItem> fusion_queue_;
+
+  rclcpp::CallbackGroup::SharedPtr imu_callback_group_;
+  rclcpp::CallbackGroup::SharedPtr measurement_callback_group_;
+  rclcpp::CallbackGroup::SharedPtr output_callback_group_;
 
   rclcpp::Subscription<geometry_msgs::msg::PoseStamped>::SharedPtr sub_initial_pose_;
   rclcpp::Subscription<sensor_msgs::msg::Imu>::SharedPtr sub_imu_;
   rclcpp::Subscription<nav_msgs::msg::Odometry>::SharedPtr sub_odom_;
   rclcpp::Subscription<geometry_msgs::msg::PoseStamped>::SharedPtr sub_gnss_pose_;
-  rclcpp::Publisher<geometry_msgs::msg::PoseStamped>::SharedPtr current_pose_pub_;
+  rclcpp::Subscription<sensor_msgs::msg::NavSatFix>::SharedPtr sub_navsat_fix_;
+  rclcpp::Subscription<tf2_msgs::msg::TFMessage>::SharedPtr sub_tf_static_;
+  rclcpp_lifecycle::LifecyclePublisher<geometry_msgs::msg::PoseStamped>::SharedPtr
+    current_pose_pub_;
+  rclcpp_lifecycle::LifecyclePublisher<std_msgs::msg::Float64>::SharedPtr latency_pub_;
+  rclcpp_lifecycle::LifecyclePublisher<geometry_msgs::msg::PoseWithCovarianceStamped>::SharedPtr
+    pose_with_covariance_pub_;
+  rclcpp_lifecycle::LifecyclePublisher<nav_msgs::msg::Odometry>::SharedPtr odometry_pub_;
+  rclcpp_lifecycle::LifecyclePublisher<tf2_msgs::msg::TFMessage>::SharedPtr tf_pub_;
+  rclcpp_lifecycle::LifecyclePublisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr
+    diagnostics_pub_;
   rclcpp::TimerBase::SharedPtr timer_;
+  rclcpp::TimerBase::SharedPtr status_timer_;
+  rclcpp::TimerBase::SharedPtr checkpoint_timer_;
+  rclcpp::node_interfaces::OnSetParametersCallbackHandle::SharedPtr parameter_callback_handle_;
+  geometry_msgs::msg::PoseStamped pose_msg_;
+  tf2_msgs::msg::TFMessage tf_msg_;
+  std_msgs::msg::Float64 latency_msg_;
+  geometry_msgs::msg::PoseWithCovarianceStamped pose_with_covariance_msg_;
+  nav_msgs::msg::Odometry odometry_msg_;
+  // set by the output path while the covariance outputs have subscribers
+  std::atomic<bool> store_covariance_{false};
+
+  // problems counted on the sensor and output paths, logged by reportStatus
+  std::atomic<uint64_t> num_dropped_measurements_{0};
+  std::atomic<uint64_t> num_tf_errors_{0};
+  std::atomic<uint64_t> num_uninitialized_publishes_{0};
+  std::atomic<uint64_t> num_imu_messages_{0};
+  std::atomic<uint64_t> num_gnss_messages_{0};
+  std::atomic<uint64_t> num_odom_messages_{0};
+  std::atomic<uint64_t> num_publishes_{0};
+  // callback execution times
+  LatencyHistogram imu_callback_time_;
+  LatencyHistogram gnss_callback_time_;
+  LatencyHistogram odom_callback_time_;
+  LatencyHistogram broadcast_time_;
+  // sensor stamp to filter update, i.e. how far the filter runs behind the sensors
+  LatencyHistogram imu_latency_;
+  LatencyHistogram gnss_latency_;
+  LatencyHistogram odom_latency_;
+  // newest sensor stamp in the published state to publish time
+  LatencyHistogram output_latency_;
+  struct StatusCounts
+  {
+    uint64_t imu_messages{0};
+    uint64_t gnss_messages{0};
+    uint64_t odom_messages{0};
+    uint64_t publishes{0};
+    uint64_t skipped_imu_samples{0};
+    uint64_t dropped_imu_samples{0};
+    uint64_t dropped_measurements{0};
+    uint64_t tf_errors{0};
+    uint64_t uninitialized_publishes{0};
+  };
+  StatusCounts reported_counts_;
+  std::chrono::steady_clock::time_point reported_time_;
+  // identifies this node in the KFL_TRACEPOINT events
+  const void * trace_node_handle_{nullptr};
   rclcpp::Clock clock_;
   tf2_ros::Buffer tfbuffer_;
   tf2_ros::TransformListener listener_;
-  tf2_ros::TransformBroadcaster broadcaster_;
-  void predictUpdate(const sensor_msgs::msg::Imu imu_msg);
+  void enqueue(const FusionItem & item);
+  // called with filter_mutex_ held
+  void processFusionItem(const FusionItem & item, const int64_t now_nanoseconds);
+  void predictUpdate(
+    const builtin_interfaces::msg::Time & stamp, const Eigen::Vector3d & gyro,
+    const Eigen::Vector3d & linear_acceleration);
+  // CovarianceT: Eigen::Vector3d (variances) or Eigen::Matrix3d (full observation covariance)
+  template<typename CovarianceT>
   void measurementUpdate(
-    const geometry_msgs::msg::PoseStamped pose_msg, const Eigen::Vector3d variance);
+    const builtin_interfaces::msg::Time & stamp, const Eigen::Vector3d & y,
+    const CovarianceT & covariance);
   void broadcastPose();
-  void initialPoseCallback(const geometry_msgs::msg::PoseStamped::SharedPtr msg);
+  void reportStatus();
+  void publishDiagnostics(
+    const StatusCounts & counts, const size_t queue_depth, const size_t max_queue_depth);
+  rcl_interfaces::msg::SetParametersResult onSetParameters(
+    const std::vector<rclcpp::Parameter> & parameters);
+  void writeCheckpoint();
+  void restoreCheckpoint();
+  void storeStateSnapshot();
+  void extrapolate(StateSnapshot & snapshot, const int64_t target_nanoseconds) const;
+  static geometry_msgs::msg::Pose toPose(const StateSnapshot & snapshot);
+  static void toPoseCovariance(const StateSnapshot & snapshot, std::array<double, 36> & covariance);
+  void toOdometry(const StateSnapshot & snapshot, nav_msgs::msg::Odometry & odometry) const;
+
+  /*
+* Publishes a message filled by fill: into loaned middleware memory when the publisher
+* can loan, into the preallocated member in real-time mode (the output publishers then skip
+* intra-process comms, see on_configure), and as an owned message otherwise (no copy for
+* intra-process subscribers). fill sets every field, including
+* the frame ids, since loaned memory starts out default constructed.
+*/
+  template<typename PublisherT, typename MessageT, typename FillT>
+  void publishMessage(PublisherT & publisher, MessageT & preallocated, FillT && fill)
+  {
+    if (publisher.can_loan_messages()) {
+      auto loaned_msg = publisher.borrow_loaned_message();
+      fill(loaned_msg.get());
+      publisher.publish(std::move(loaned_msg));
+    } else if (real_time_mode_) {
+      fill(preallocated);
+      publisher.publish(preallocated);
+    } else {
+      auto owned_msg = std::make_unique<MessageT>();
+      fill(*owned_msg);
+      publisher.publish(std::move(owned_msg));
+    }
+  }
+
+  template<typename PublisherT>
+  static bool hasSubscribers(const PublisherT & publisher)
+  {
+    return publisher.get_subscription_count() + publisher.get_intra_process_subscription_count() >
+           0;
+  }
+  void initialPoseCallback(const geometry_msgs::msg::PoseStamped::ConstSharedPtr msg);
 
   geometry_msgs::msg::PoseStamped current_pose_odom_;
   Eigen::Matrix4d previous_odom_mat_{Eigen::Matrix4d::Identity()};
   std::optional<geometry_msgs::msg::PoseStamped> initial_pose_;
+  // navsat fix -> reference_frame_id (east-north-up), origin fixed by navsat_origin or the
+  // first fix; only used by the navsat fix callback
+  LocalCartesian local_cartesian_;
+  // robot_frame_id <- imu_frame_id rotation, cached when use_static_imu_extrinsic is set
+  std::optional<Eigen::Matrix3d> imu_rotation_;
+  std::string imu_frame_id_;
 
   enum STATE {
     X = 0,
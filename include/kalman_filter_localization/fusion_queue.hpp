@@ -0,0 +1,131 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef KALMAN_FILTER_LOCALIZATION__FUSION_QUEUE_HPP_
+#define KALMAN_FILTER_LOCALIZATION__FUSION_QUEUE_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/*
+* Bounded min-heap of sensor samples keyed on their stamp [nsec], drained in time order.
+*
+* A sample becomes ready once it is older than the newest pushed stamp by the reorder
+* window, so samples arriving out of order within the window are still drained in order.
+* Samples older than the last drained one are rejected, as is everything pushed into a
+* full queue; both count as dropped. Equal stamps keep their push order.
+* All storage is allocated by reset().
+*/
+template<typename T>
+class FusionQueue
+{
+public:
+  void reset(const size_t capacity, const int64_t reorder_window)
+  {
+    heap_.clear();
+    heap_.reserve(capacity);
+    capacity_ = capacity;
+    reorder_window_ = reorder_window;
+    newest_stamp_ = std::numeric_limits<int64_t>::min();
+    last_popped_stamp_ = std::numeric_limits<int64_t>::min();
+    sequence_ = 0;
+    dropped_ = 0;
+    max_size_ = 0;
+  }
+
+  bool push(const int64_t stamp, const T & item)
+  {
+    if (late(stamp) || full()) {
+      ++dropped_;
+      return false;
+    }
+    heap_.push_back(Entry{stamp, sequence_++, item});
+    std::push_heap(heap_.begin(), heap_.end(), later);
+    newest_stamp_ = std::max(newest_stamp_, stamp);
+    max_size_ = std::max(max_size_, heap_.size());
+    return true;
+  }
+
+  /* true if a sample with this stamp could no longer be drained in order */
+  bool late(const int64_t stamp) const { return stamp < last_popped_stamp_; }
+
+  bool ready() const
+  {
+    return !heap_.empty() && heap_.front().stamp + reorder_window_ <= newest_stamp_;
+  }
+
+  /* oldest sample; the queue must not be empty */
+  T pop()
+  {
+    std::pop_heap(heap_.begin(), heap_.end(), later);
+    const Entry entry = heap_.back();
+    heap_.pop_back();
+    last_popped_stamp_ = entry.stamp;
+    return entry.item;
+  }
+
+  bool empty() const { return heap_.empty(); }
+
+  bool full() const { return heap_.size() >= capacity_; }
+
+  size_t size() const { return heap_.size(); }
+
+  size_t maxSize() const { return max_size_; }
+
+  uint64_t dropped() const { return dropped_; }
+
+private:
+  struct Entry
+  {
+    int64_t stamp;
+    uint64_t sequence;
+    T item;
+  };
+
+  static bool later(const Entry & a, const Entry & b)
+  {
+    return a.stamp > b.stamp || (a.stamp == b.stamp && a.sequence > b.sequence);
+  }
+
+  std::vector<Entry> heap_;
+  size_t capacity_{0};
+  int64_t reorder_window_{0};
+  int64_t newest_stamp_{std::numeric_limits<int64_t>::min()};
+  int64_t last_popped_stamp_{std::numeric_limits<int64_t>::min()};
+  uint64_t sequence_{0};
+  uint64_t dropped_{0};
+  size_t max_size_{0};
+};
+
+#endif  // KALMAN_FILTER_LOCALIZATION__FUSION_QUEUE_HPP_
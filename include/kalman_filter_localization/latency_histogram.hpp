@@ -0,0 +1,177 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef KALMAN_FILTER_LOCALIZATION__LATENCY_HISTOGRAM_HPP_
+#define KALMAN_FILTER_LOCALIZATION__LATENCY_HISTOGRAM_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+* Lock-free log-linear histogram of durations [nsec], in the spirit of HdrHistogram.
+*
+* Values are bucketed by their power of two and 8 linear sub-buckets within it, so a bucket
+* is at most 12.5% of its values wide; values from 2^41 nsec (~37 min) on share the last
+* bucket and negative values count as 0. record() is wait-free (relaxed atomic adds) and
+* may be called from any thread. drain() takes the counts out for a report and starts the
+* next interval; records racing with it land in one interval or the other, none are lost.
+*/
+class LatencyHistogram
+{
+public:
+  struct Summary
+  {
+    uint64_t count;
+    double mean;
+    // upper bounds of the buckets holding the percentiles (at most max), and the exact max
+    int64_t p50;
+    int64_t p90;
+    int64_t p99;
+    int64_t max;
+  };
+
+  /* records the time from construction to destruction */
+  class Scope
+  {
+public:
+    explicit Scope(LatencyHistogram & histogram)
+    : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+
+    ~Scope()
+    {
+      histogram_.record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start_).count());
+    }
+
+private:
+    LatencyHistogram & histogram_;
+    const std::chrono::steady_clock::time_point start_;
+  };
+
+  LatencyHistogram()
+  {
+    for (std::atomic<uint64_t> & count : counts_) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void record(int64_t value)
+  {
+    value = value < 0 ? 0 : value;
+    counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    int64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  Summary drain()
+  {
+    std::array<uint64_t, num_buckets_> counts;
+    Summary summary{};
+    for (int i = 0; i < num_buckets_; ++i) {
+      counts[i] = counts_[i].exchange(0, std::memory_order_relaxed);
+      summary.count += counts[i];
+    }
+    const int64_t sum = sum_.exchange(0, std::memory_order_relaxed);
+    summary.max = max_.exchange(0, std::memory_order_relaxed);
+    if (summary.count == 0) {
+      return summary;
+    }
+    summary.mean = static_cast<double>(sum) / summary.count;
+    summary.p50 = std::min(percentile(counts, summary.count, 0.5), summary.max);
+    summary.p90 = std::min(percentile(counts, summary.count, 0.9), summary.max);
+    summary.p99 = std::min(percentile(counts, summary.count, 0.99), summary.max);
+    return summary;
+  }
+
+private:
+  static const int sub_bucket_bits_{3};
+  static const int num_sub_buckets_{1 << sub_bucket_bits_};
+  static const int max_exponent_{40};
+  // values below num_sub_buckets_ are exact, then num_sub_buckets_ per power of two
+  static const int num_buckets_{(max_exponent_ - sub_bucket_bits_ + 2) * num_sub_buckets_};
+
+  static int index(const int64_t value)
+  {
+    if (value < num_sub_buckets_) {
+      return static_cast<int>(value);
+    }
+#ifdef __GNUC__
+    const int exponent = 63 - __builtin_clzll(static_cast<uint64_t>(value));
+#else
+    int exponent = 0;
+    while ((value >> (exponent + 1)) != 0) {
+      ++exponent;
+    }
+#endif
+    if (exponent > max_exponent_) {
+      return num_buckets_ - 1;
+    }
+    const int shift = exponent - sub_bucket_bits_;
+    const int sub_bucket = static_cast<int>(value >> shift) - num_sub_buckets_;
+    return (shift + 1) * num_sub_buckets_ + sub_bucket;
+  }
+
+  static int64_t upperBound(const int i)
+  {
+    if (i < num_sub_buckets_) {
+      return i;
+    }
+    const int shift = i / num_sub_buckets_ - 1;
+    const int64_t sub_bucket = i % num_sub_buckets_;
+    return ((num_sub_buckets_ + sub_bucket + 1) << shift) - 1;
+  }
+
+  static int64_t percentile(
+    const std::array<uint64_t, num_buckets_> & counts, const uint64_t count, const double q)
+  {
+    const uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < num_buckets_; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return upperBound(i);
+      }
+    }
+    return upperBound(num_buckets_ - 1);
+  }
+
+  std::array<std::atomic<uint64_t>, num_buckets_> counts_;
+  std::atomic<int64_t> sum_{0};
+  std::atomic<int64_t> max_{0};
+};
+
+#endif  // KALMAN_FILTER_LOCALIZATION__LATENCY_HISTOGRAM_HPP_
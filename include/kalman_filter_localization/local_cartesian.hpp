@@ -0,0 +1,102 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef KALMAN_FILTER_LOCALIZATION__LOCAL_CARTESIAN_HPP_
+#define KALMAN_FILTER_LOCALIZATION__LOCAL_CARTESIAN_HPP_
+
+#include <Eigen/Core>
+#include <cmath>
+
+namespace kalman_filter_localization
+{
+/*
+* WGS84 geodetic coordinates (latitude, longitude [deg], ellipsoidal altitude [m]) to a local
+* east-north-up frame with a fixed origin. setOrigin computes the origin's ECEF position and
+* the ECEF -> ENU rotation once, so forward is the geodetic -> ECEF step and a 3x3 product.
+*/
+class LocalCartesian
+{
+public:
+  void setOrigin(const double latitude, const double longitude, const double altitude)
+  {
+    const double phi = latitude * kDegToRad;
+    const double lambda = longitude * kDegToRad;
+    const double sin_phi = std::sin(phi);
+    const double cos_phi = std::cos(phi);
+    const double sin_lambda = std::sin(lambda);
+    const double cos_lambda = std::cos(lambda);
+    origin_ecef_ = toEcef(latitude, longitude, altitude);
+    rotation_ <<
+      -sin_lambda, cos_lambda, 0.0,
+      -sin_phi * cos_lambda, -sin_phi * sin_lambda, cos_phi,
+      cos_phi * cos_lambda, cos_phi * sin_lambda, sin_phi;
+    has_origin_ = true;
+  }
+
+  void reset() { has_origin_ = false; }
+
+  bool hasOrigin() const { return has_origin_; }
+
+  /* position in the east-north-up frame at the origin [m] */
+  Eigen::Vector3d forward(const double latitude, const double longitude, const double altitude)
+  const
+  {
+    return rotation_ * (toEcef(latitude, longitude, altitude) - origin_ecef_);
+  }
+
+  static Eigen::Vector3d toEcef(
+    const double latitude, const double longitude, const double altitude)
+  {
+    const double phi = latitude * kDegToRad;
+    const double lambda = longitude * kDegToRad;
+    const double sin_phi = std::sin(phi);
+    const double cos_phi = std::cos(phi);
+    // prime vertical radius of curvature
+    const double n = kSemiMajorAxis / std::sqrt(1.0 - kEccentricity2 * sin_phi * sin_phi);
+    return Eigen::Vector3d(
+      (n + altitude) * cos_phi * std::cos(lambda),
+      (n + altitude) * cos_phi * std::sin(lambda),
+      (n * (1.0 - kEccentricity2) + altitude) * sin_phi);
+  }
+
+private:
+  static constexpr double kDegToRad = M_PI / 180.0;
+  static constexpr double kSemiMajorAxis = 6378137.0;
+  static constexpr double kFlattening = 1.0 / 298.257223563;
+  static constexpr double kEccentricity2 = kFlattening * (2.0 - kFlattening);
+
+  bool has_origin_{false};
+  Eigen::Vector3d origin_ecef_{Eigen::Vector3d::Zero()};
+  Eigen::Matrix3d rotation_{Eigen::Matrix3d::Identity()};
+};
+}  // namespace kalman_filter_localization
+
+#endif  // KALMAN_FILTER_LOCALIZATION__LOCAL_CARTESIAN_HPP_
@@ -0,0 +1,128 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef KALMAN_FILTER_LOCALIZATION__RING_BUFFER_HPP_
+#define KALMAN_FILTER_LOCALIZATION__RING_BUFFER_HPP_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/*
+* Fixed-capacity circular buffer. All storage is allocated by reserve(); afterwards
+* push_back() and insert() overwrite the oldest element when full and never allocate.
+* Index 0 is the oldest element.
+*/
+template<typename T, typename Allocator = std::allocator<T>>
+class RingBuffer
+{
+public:
+  void reserve(const size_t capacity)
+  {
+    buffer_.assign(capacity, T());
+    head_ = 0;
+    size_ = 0;
+  }
+
+  void clear()
+  {
+    head_ = 0;
+    size_ = 0;
+  }
+
+  size_t capacity() const { return buffer_.size(); }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  bool full() const { return size_ == buffer_.size(); }
+
+  T & operator[](const size_t i) { return buffer_[(head_ + i) % buffer_.size()]; }
+
+  const T & operator[](const size_t i) const { return buffer_[(head_ + i) % buffer_.size()]; }
+
+  T & front() { return (*this)[0]; }
+
+  const T & front() const { return (*this)[0]; }
+
+  T & back() { return (*this)[size_ - 1]; }
+
+  const T & back() const { return (*this)[size_ - 1]; }
+
+  /* appends a slot (dropping the oldest element when full) and returns it for the caller to fill */
+  T & push_back()
+  {
+    if (full()) {
+      head_ = (head_ + 1) % buffer_.size();
+    } else {
+      ++size_;
+    }
+    return back();
+  }
+
+  void push_back(const T & value) { push_back() = value; }
+
+  void pop_front()
+  {
+    head_ = (head_ + 1) % buffer_.size();
+    --size_;
+  }
+
+  /*
+* inserts value before index i, shifting the newer elements back.
+* When full, the oldest element is dropped first, so a value that would become
+* the oldest element is not inserted at all. Returns whether it was inserted.
+*/
+  bool insert(size_t i, const T & value)
+  {
+    if (full()) {
+      if (i == 0) {
+        return false;
+      }
+      pop_front();
+      --i;
+    }
+    push_back();
+    for (size_t j = size_ - 1; j > i; --j) {
+      (*this)[j] = (*this)[j - 1];
+    }
+    (*this)[i] = value;
+    return true;
+  }
+
+private:
+  std::vector<T, Allocator> buffer_;
+  size_t head_{0};
+  size_t size_{0};
+};
+
+#endif  // KALMAN_FILTER_LOCALIZATION__RING_BUFFER_HPP_
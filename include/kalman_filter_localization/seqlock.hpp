@@ -0,0 +1,97 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef KALMAN_FILTER_LOCALIZATION__SEQLOCK_HPP_
+#define KALMAN_FILTER_LOCALIZATION__SEQLOCK_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/*
+* Single-writer sequence lock for a small trivially copyable value.
+*
+* store() never blocks and never waits for readers; load() retries while a store is in
+* progress, so readers never block the writer. The value is kept in relaxed atomic
+* words, so concurrent access is well defined. Concurrent writers must be serialized
+* by the caller.
+*/
+template<typename T>
+class SeqLock
+{
+  static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+public:
+  SeqLock() { store(T()); }
+
+  void store(const T & value)
+  {
+    std::array<uint64_t, num_words_> words{};
+    std::memcpy(words.data(), &value, sizeof(T));
+
+    const uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);  // odd: store in progress
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < num_words_; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  T load() const
+  {
+    std::array<uint64_t, num_words_> words;
+    uint64_t sequence_before;
+    uint64_t sequence_after;
+    do {
+      sequence_before = sequence_.load(std::memory_order_acquire);
+      for (size_t i = 0; i < num_words_; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      sequence_after = sequence_.load(std::memory_order_relaxed);
+    } while ((sequence_before & 1) || sequence_before != sequence_after);
+
+    T value;
+    std::memcpy(&value, words.data(), sizeof(T));
+    return value;
+  }
+
+private:
+  static const size_t num_words_{(sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t)};
+
+  std::atomic<uint64_t> sequence_{0};
+  std::array<std::atomic<uint64_t>, num_words_> words_;
+};
+
+#endif  // KALMAN_FILTER_LOCALIZATION__SEQLOCK_HPP_
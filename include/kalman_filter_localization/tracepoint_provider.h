@@ -0,0 +1,81 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+/*
+* LTTng-UST tracepoint provider, compiled in with KFL_ENABLE_TRACING; use it through
+* KFL_TRACEPOINT (tracing.hpp). Every event carries the rcl node handle (as ros2_tracing's
+* rcl_node_init does, to tell nodes apart) and the stamp [nsec] of the message it handles.
+*/
+#undef TRACEPOINT_PROVIDER
+#define TRACEPOINT_PROVIDER kalman_filter_localization
+
+#undef TRACEPOINT_INCLUDE
+#define TRACEPOINT_INCLUDE "kalman_filter_localization/tracepoint_provider.h"
+
+#if !defined(KALMAN_FILTER_LOCALIZATION__TRACEPOINT_PROVIDER_H_) || \
+  defined(TRACEPOINT_HEADER_MULTI_READ)
+#define KALMAN_FILTER_LOCALIZATION__TRACEPOINT_PROVIDER_H_
+
+#include <lttng/tracepoint.h>
+#include <stdint.h>
+
+TRACEPOINT_EVENT_CLASS(
+  kalman_filter_localization,
+  stamp_event,
+  TP_ARGS(
+    const void *, node_handle_arg,
+    int64_t, stamp_arg),
+  TP_FIELDS(
+    ctf_integer_hex(const void *, node_handle, node_handle_arg)
+    ctf_integer(int64_t, stamp, stamp_arg)))
+
+#define KFL_TRACEPOINT_STAMP_EVENT(event_name) \
+  TRACEPOINT_EVENT_INSTANCE( \
+    kalman_filter_localization, stamp_event, event_name, \
+    TP_ARGS(const void *, node_handle_arg, int64_t, stamp_arg))
+
+// sensor callbacks entered
+KFL_TRACEPOINT_STAMP_EVENT(imu_received)
+KFL_TRACEPOINT_STAMP_EVENT(gnss_received)
+KFL_TRACEPOINT_STAMP_EVENT(odom_received)
+// imu sample rotated into robot_frame_id, about to be queued
+KFL_TRACEPOINT_STAMP_EVENT(imu_transformed)
+// around EKFEstimator::predictionUpdate / observationUpdate
+KFL_TRACEPOINT_STAMP_EVENT(prediction_start)
+KFL_TRACEPOINT_STAMP_EVENT(prediction_end)
+KFL_TRACEPOINT_STAMP_EVENT(observation_start)
+KFL_TRACEPOINT_STAMP_EVENT(observation_end)
+// pose published; the stamp is that of the published state
+KFL_TRACEPOINT_STAMP_EVENT(pose_published)
+
+#endif  // KALMAN_FILTER_LOCALIZATION__TRACEPOINT_PROVIDER_H_
+
+#include <lttng/tracepoint-event.h>
@@ -0,0 +1,361 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+/*
+* Offline replay: reads imu, gnss pose and odometry straight from a rosbag2 file, runs
+* EKFEstimator over them in stamp order as fast as possible and writes the estimate to CSV.
+*
+* ekf_bag_replay <bag> <output.csv> [--name value ...]
+*
+* options (defaults in brackets, names and meaning as the node parameters):
+*   --imu_topic [/imu] --gnss_pose_topic [/gnss_pose] --odom_topic [/odom]
+*   --robot_frame_id [base_link] --storage_id [sqlite3]
+*   --var_imu_w [0.01] --var_imu_acc [0.01] --var_gnss_xy [0.1] --var_gnss_z [0.15]
+*   --var_odom_xyz [0.2] --use_gnss [1] --use_odom [0]
+*   --preintegration_batch_size [1] --history_capacity [0] --use_square_root_filter [0]
+*   --reorder_window [0.1] sec a sample may arrive late in the bag
+*   --output_decimation [1] imu samples per written row
+*   --output_covariance [1] write the position variances (var_x, var_y, var_z)
+*
+* Reading the covariance flushes the preintegrated samples, so --output_covariance 1 cuts
+* the preintegration batches at every written row; turn it off to replay a
+* preintegration_batch_size above output_decimation as the node runs it.
+*
+* The filter starts at the first gnss pose. The imu rotation is taken from the
+* robot_frame_id -> imu frame transform on /tf_static if the bag has one.
+*/
+#include <kalman_filter_localization/ekf.hpp>
+#include <kalman_filter_localization/fusion_queue.hpp>
+
+#include <geometry_msgs/msg/pose_stamped.hpp>
+#include <nav_msgs/msg/odometry.hpp>
+#include <rclcpp/serialization.hpp>
+#include <rclcpp/serialized_message.hpp>
+#include <rosbag2_cpp/converter_options.hpp>
+#include <rosbag2_cpp/reader.hpp>
+#include <rosbag2_storage/storage_filter.hpp>
+#include <rosbag2_storage/storage_options.hpp>
+#include <sensor_msgs/msg/imu.hpp>
+#include <tf2_eigen/tf2_eigen.hpp>
+#include <tf2_msgs/msg/tf_message.hpp>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+struct Sample
+{
+  enum Type { IMU, GNSS, ODOM } type;
+  int64_t stamp;
+  Eigen::Vector3d first;  // gyro or position
+  Eigen::Vector3d second;  // linear acceleration (imu only)
+  Eigen::Quaterniond orientation;  // gnss/odom only
+  std::string frame_id;  // imu only
+};
+
+class Options
+{
+public:
+  Options(int argc, char ** argv)
+  {
+    for (int i = 3; i + 1 < argc; i += 2) {
+      std::string name = argv[i];
+      if (name.rfind("--", 0) != 0) {
+        throw std::invalid_argument("unexpected argument " + name);
+      }
+      values_[name.substr(2)] = argv[i + 1];
+    }
+  }
+
+  std::string get(const std::string & name, const std::string & default_value) const
+  {
+    auto it = values_.find(name);
+    return it == values_.end() ? default_value : it->second;
+  }
+
+  double get(const std::string & name, const double default_value) const
+  {
+    auto it = values_.find(name);
+    return it == values_.end() ? default_value : std::stod(it->second);
+  }
+
+private:
+  std::map<std::string, std::string> values_;
+};
+
+template<typename MessageT>
+MessageT deserialize(const rosbag2_storage::SerializedBagMessage & bag_message)
+{
+  static rclcpp::Serialization<MessageT> serialization;
+  const rclcpp::SerializedMessage serialized(*bag_message.serialized_data);
+  MessageT message;
+  serialization.deserialize_message(&serialized, &message);
+  return message;
+}
+
+int64_t toNanoseconds(const builtin_interfaces::msg::Time & stamp)
+{
+  return static_cast<int64_t>(stamp.sec) * 1000000000 + stamp.nanosec;
+}
+
+enum STATE {
+  X = 0,
+  Y = 1,
+  Z = 2,
+  VX = 3,
+  VY = 4,
+  VZ = 5,
+  QX = 6,
+  QY = 7,
+  QZ = 8,
+  QW = 9,
+};
+
+Eigen::Isometry3d toIsometry(const EKFEstimator::StateVector & x)
+{
+  Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+  pose.translation() = x.segment<3>(STATE::X);
+  pose.linear() =
+    Eigen::Quaterniond(x(STATE::QW), x(STATE::QX), x(STATE::QY), x(STATE::QZ)).toRotationMatrix();
+  return pose;
+}
+}  // namespace
+
+int main(int argc, char ** argv)
+{
+  if (argc < 3) {
+    std::fprintf(stderr, "usage: %s <bag> <output.csv> [--name value ...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const std::string bag_uri = argv[1];
+  const std::string output_path = argv[2];
+
+  try {
+    const Options options(argc, argv);
+    const std::string imu_topic = options.get("imu_topic", std::string("/imu"));
+    const std::string gnss_pose_topic = options.get("gnss_pose_topic", std::string("/gnss_pose"));
+    const std::string odom_topic = options.get("odom_topic", std::string("/odom"));
+    const std::string robot_frame_id = options.get("robot_frame_id", std::string("base_link"));
+    const bool use_gnss = options.get("use_gnss", 1.0) != 0.0;
+    const bool use_odom = options.get("use_odom", 0.0) != 0.0;
+    const double var_gnss_xy = options.get("var_gnss_xy", 0.1);
+    const Eigen::Vector3d var_gnss(var_gnss_xy, var_gnss_xy, options.get("var_gnss_z", 0.15));
+    const Eigen::Vector3d var_odom = Eigen::Vector3d::Constant(options.get("var_odom_xyz", 0.2));
+    const int output_decimation =
+      std::max(static_cast<int>(options.get("output_decimation", 1.0)), 1);
+    const bool output_covariance = options.get("output_covariance", 1.0) != 0.0;
+
+    EKFEstimator ekf(
+      options.get("use_square_root_filter", 0.0) != 0.0 ?
+      EKFEstimator::CovarianceForm::SQUARE_ROOT : EKFEstimator::CovarianceForm::DENSE);
+    ekf.setVarImuGyro(options.get("var_imu_w", 0.01));
+    ekf.setVarImuAcc(options.get("var_imu_acc", 0.01));
+    ekf.setPreintegrationBatchSize(static_cast<int>(options.get("preintegration_batch_size", 1.0)));
+    ekf.setHistoryCapacity(static_cast<size_t>(options.get("history_capacity", 0.0)));
+
+    rosbag2_storage::StorageOptions storage_options;
+    storage_options.uri = bag_uri;
+    storage_options.storage_id = options.get("storage_id", std::string("sqlite3"));
+    rosbag2_cpp::ConverterOptions converter_options;
+    converter_options.input_serialization_format = "cdr";
+    converter_options.output_serialization_format = "cdr";
+    rosbag2_cpp::Reader reader;
+    reader.open(storage_options, converter_options);
+    rosbag2_storage::StorageFilter filter;
+    filter.topics = {imu_topic, gnss_pose_topic, odom_topic, "/tf_static"};
+    reader.set_filter(filter);
+
+    std::FILE * output = std::fopen(output_path.c_str(), "w");
+    if (output == nullptr) {
+      std::fprintf(stderr, "cannot open %s\n", output_path.c_str());
+      return EXIT_FAILURE;
+    }
+    static char output_buffer[1 << 20];
+    std::setvbuf(output, output_buffer, _IOFBF, sizeof(output_buffer));
+    std::fprintf(
+      output, "stamp,x,y,z,vx,vy,vz,qx,qy,qz,qw%s\n",
+      output_covariance ? ",var_x,var_y,var_z" : "");
+
+    // the bag is in receive order, the queue restores the stamp order
+    FusionQueue<Sample> queue;
+    queue.reset(100000, static_cast<int64_t>(options.get("reorder_window", 0.1) * 1e9));
+
+    std::map<std::string, Eigen::Matrix3d> imu_rotations;  // robot_frame_id <- imu frame
+    bool initialized = false;
+    bool has_previous_odom = false;
+    Eigen::Isometry3d previous_odom = Eigen::Isometry3d::Identity();
+    Eigen::Isometry3d pose_at_previous_odom = Eigen::Isometry3d::Identity();
+    uint64_t num_imu = 0;
+    uint64_t num_measurements = 0;
+    int64_t first_stamp = 0;
+    int64_t last_stamp = 0;
+
+    auto process = [&](const Sample & sample) {
+      if (first_stamp == 0) {
+        first_stamp = sample.stamp;
+      }
+      last_stamp = sample.stamp;
+      const double stamp = sample.stamp * 1e-9;
+      if (!initialized) {
+        if (sample.type != Sample::GNSS) {
+          return;
+        }
+        EKFEstimator::StateVector x = EKFEstimator::StateVector::Zero();
+        x.segment<3>(STATE::X) = sample.first;
+        x.segment<4>(STATE::QX) = sample.orientation.coeffs();
+        ekf.setInitialX(x);
+        initialized = true;
+        return;
+      }
+      if (sample.type == Sample::IMU) {
+        auto rotation = imu_rotations.find(sample.frame_id);
+        if (rotation == imu_rotations.end()) {
+          ekf.predictionUpdate(stamp, sample.first, sample.second);
+        } else {
+          ekf.predictionUpdate(
+            stamp, rotation->second * sample.first, rotation->second * sample.second);
+        }
+        if (++num_imu % output_decimation == 0) {
+          const EKFEstimator::StateVector & x = ekf.getX();
+          std::fprintf(
+            output, "%.9f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.9f,%.9f,%.9f,%.9f", stamp, x(0), x(1),
+            x(2), x(3), x(4), x(5), x(6), x(7), x(8), x(9));
+          if (output_covariance) {
+            // flushes the preintegration, see --output_covariance
+            const EKFEstimator::EigenMatrix9d & P = ekf.getCoveriance();
+            std::fprintf(output, ",%.6g,%.6g,%.6g", P(0, 0), P(1, 1), P(2, 2));
+          }
+          std::fputc('\n', output);
+        }
+      } else if (sample.type == Sample::GNSS) {
+        if (use_gnss) {
+          ekf.observationUpdateDiagonal(stamp, sample.first, var_gnss);
+          ++num_measurements;
+        }
+      } else if (use_odom) {
+        // odometry increment applied to the filter pose at the previous odometry sample,
+        // as in the node
+        Eigen::Isometry3d odom = Eigen::Isometry3d::Identity();
+        odom.translation() = sample.first;
+        odom.linear() = sample.orientation.toRotationMatrix();
+        if (has_previous_odom) {
+          const Eigen::Isometry3d predicted = pose_at_previous_odom * previous_odom.inverse() *
+            odom;
+          ekf.observationUpdateDiagonal(stamp, predicted.translation(), var_odom);
+          ++num_measurements;
+        }
+        pose_at_previous_odom = toIsometry(ekf.getX());
+        previous_odom = odom;
+        has_previous_odom = true;
+      }
+    };
+
+    const auto wall_start = std::chrono::steady_clock::now();
+    while (reader.has_next()) {
+      const auto bag_message = reader.read_next();
+      Sample sample;
+      if (bag_message->topic_name == imu_topic) {
+        const auto msg = deserialize<sensor_msgs::msg::Imu>(*bag_message);
+        sample.type = Sample::IMU;
+        sample.stamp = toNanoseconds(msg.header.stamp);
+        sample.first = Eigen::Vector3d(
+          msg.angular_velocity.x, msg.angular_velocity.y, msg.angular_velocity.z);
+        sample.second = Eigen::Vector3d(
+          msg.linear_acceleration.x, msg.linear_acceleration.y, msg.linear_acceleration.z);
+        sample.frame_id = msg.header.frame_id;
+      } else if (bag_message->topic_name == gnss_pose_topic) {
+        const auto msg = deserialize<geometry_msgs::msg::PoseStamped>(*bag_message);
+        sample.type = Sample::GNSS;
+        sample.stamp = toNanoseconds(msg.header.stamp);
+        sample.first =
+          Eigen::Vector3d(msg.pose.position.x, msg.pose.position.y, msg.pose.position.z);
+        sample.orientation = Eigen::Quaterniond(
+          msg.pose.orientation.w, msg.pose.orientation.x, msg.pose.orientation.y,
+          msg.pose.orientation.z);
+      } else if (bag_message->topic_name == odom_topic) {
+        const auto msg = deserialize<nav_msgs::msg::Odometry>(*bag_message);
+        sample.type = Sample::ODOM;
+        sample.stamp = toNanoseconds(msg.header.stamp);
+        sample.first = Eigen::Vector3d(
+          msg.pose.pose.position.x, msg.pose.pose.position.y, msg.pose.pose.position.z);
+        sample.orientation = Eigen::Quaterniond(
+          msg.pose.pose.orientation.w, msg.pose.pose.orientation.x, msg.pose.pose.orientation.y,
+          msg.pose.pose.orientation.z);
+      } else {
+        const auto msg = deserialize<tf2_msgs::msg::TFMessage>(*bag_message);
+        for (const auto & transform : msg.transforms) {
+          if (transform.header.frame_id == robot_frame_id) {
+            imu_rotations[transform.child_frame_id] = tf2::transformToEigen(transform).linear();
+          }
+        }
+        continue;
+      }
+      if (queue.full()) {
+        process(queue.pop());
+      }
+      queue.push(sample.stamp, sample);
+      while (queue.ready()) {
+        process(queue.pop());
+      }
+    }
+    while (!queue.empty()) {
+      process(queue.pop());
+    }
+    std::fclose(output);
+
+    const double wall_time =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    const double data_time = (last_stamp - first_stamp) * 1e-9;
+    std::printf(
+      "%lu imu samples, %lu measurements, %lu late samples dropped, %lu imu gaps\n"
+      "%.1f s of data in %.2f s (%.0fx real time)\n",
+      static_cast<unsigned long>(num_imu), static_cast<unsigned long>(num_measurements),  // NOLINT
+      static_cast<unsigned long>(queue.dropped()),  // NOLINT
+      static_cast<unsigned long>(ekf.getNumSkippedImuSamples()),  // NOLINT
+      data_time, wall_time, wall_time > 0 ? data_time / wall_time : 0.0);
+  } catch (const std::exception & e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -29,9 +29,14 @@
 // LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
 // ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <initializer_list>
 #include <kalman_filter_localization/ekf_localization_component.hpp>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 using namespace std::chrono_literals;
@@ -39,105 +44,313 @@ using namespace std::chrono_literals;
 namespace kalman_filter_localization
 {
 EkfLocalizationComponent::EkfLocalizationComponent(const rclcpp::NodeOptions & options)
-: Node("ekf_localization", options),
+: rclcpp_lifecycle::LifecycleNode("ekf_localization", options),
   clock_(RCL_ROS_TIME),
   tfbuffer_(std::make_shared<rclcpp::Clock>(clock_)),
   listener_(tfbuffer_),
-  broadcaster_(this),
   initial_pose_(std::nullopt)
 {
   declare_parameter("reference_frame_id", "map");
-  get_parameter("reference_frame_id", reference_frame_id_);
   declare_parameter("robot_frame_id", "base_link");
-  get_parameter("robot_frame_id", robot_frame_id_);
   declare_parameter("initial_pose_topic", get_name() + std::string("/initial_pose"));
-  get_parameter("initial_pose_topic", initial_pose_topic_);
   declare_parameter("imu_topic", get_name() + std::string("/imu"));
-  get_parameter("imu_topic", imu_topic_);
   declare_parameter("odom_topic", get_name() + std::string("/odom"));
-  get_parameter("odom_topic", odom_topic_);
   declare_parameter("gnss_pose_topic", get_name() + std::string("/gnss_pose"));
-  get_parameter("gnss_pose_topic", gnss_pose_topic_);
-
+  declare_parameter("navsat_fix_topic", get_name() + std::string("/navsat_fix"));
   declare_parameter("pub_period", 10);
-  get_parameter("pub_period", pub_period_);
+  declare_parameter("publish_mode", "timer");
+  declare_parameter("publish_imu_decimation", 1);
+  declare_parameter("publish_latency", false);
+  declare_parameter("extrapolate_to_publish_time", false);
+  declare_parameter("max_extrapolation_horizon", 0.05);
   declare_parameter("var_imu_w", 0.01);
-  get_parameter("var_imu_w", var_imu_w_);
   declare_parameter("var_imu_acc", 0.01);
-  get_parameter("var_imu_acc", var_imu_acc_);
   declare_parameter("var_gnss_xy", 0.1);
-  get_parameter("var_gnss_xy", var_gnss_xy_);
   declare_parameter("var_gnss_z", 0.15);
-  get_parameter("var_gnss_z", var_gnss_z_);
   declare_parameter("var_odom_xyz", 0.2);
-  get_parameter("var_odom_xyz", var_odom_xyz_);
   declare_parameter("use_gnss", true);
-  get_parameter("use_gnss", use_gnss_);
   declare_parameter("use_odom", false);
-  get_parameter("use_odom", use_odom_);
   declare_parameter("use_gnss_as_initial_pose", false);
-  get_parameter("use_gnss_as_initial_pose", use_gnss_as_initial_pose_);
+  declare_parameter("use_navsat_fix", false);
+  declare_parameter("navsat_origin", std::vector<double>{});
   declare_parameter("broadcast_tf_topic", true);
+  declare_parameter("use_square_root_filter", false);
+  declare_parameter("preintegration_batch_size", 1);
+  declare_parameter("history_capacity", 0);
+  declare_parameter("use_static_imu_extrinsic", false);
+  declare_parameter("real_time_mode", false);
+  declare_parameter("thread_priority", 0);
+  declare_parameter("cpu_affinity", std::vector<int64_t>{});
+  declare_parameter("fusion_queue_capacity", 200);
+  declare_parameter("fusion_reorder_window", 0.0);
+  declare_parameter("publish_diagnostics", true);
+  declare_parameter("checkpoint_path", "");
+  declare_parameter("checkpoint_period", 1.0);
+  declare_parameter("max_checkpoint_age", 10.0);
+  declare_parameter("autostart", true);
+
+  trace_node_handle_ = get_node_base_interface()->get_rcl_node_handle();
+
+  parameter_callback_handle_ = add_on_set_parameters_callback(
+    std::bind(&EkfLocalizationComponent::onSetParameters, this, std::placeholders::_1));
+}
+
+/*
+* Noise variances, sensor enables, pub_period and publish_imu_decimation are applied
+* right away, under filter_mutex_, without touching the subscriptions. Everything else
+* is read on the next configure.
+*/
+rcl_interfaces::msg::SetParametersResult EkfLocalizationComponent::onSetParameters(
+  const std::vector<rclcpp::Parameter> & parameters)
+{
+  rcl_interfaces::msg::SetParametersResult result;
+  result.successful = true;
+  for (const rclcpp::Parameter & parameter : parameters) {
+    const std::string & name = parameter.get_name();
+    if (name.rfind("var_", 0) == 0 &&
+      parameter.get_type() == rclcpp::ParameterType::PARAMETER_DOUBLE &&
+      parameter.as_double() <= 0.0)
+    {
+      result.successful = false;
+      result.reason = name + " must be positive";
+    } else if ((name == "pub_period" || name == "publish_imu_decimation") &&
+      parameter.get_type() == rclcpp::ParameterType::PARAMETER_INTEGER &&
+      parameter.as_int() < 1)
+    {
+      result.successful = false;
+      result.reason = name + " must be at least 1";
+    }
+  }
+  if (!result.successful) {
+    return result;
+  }
+
+  bool restart_timer = false;
+  {
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    for (const rclcpp::Parameter & parameter : parameters) {
+      const std::string & name = parameter.get_name();
+      if (name == "var_imu_w") {
+        var_imu_w_ = parameter.as_double();
+        ekf_.setVarImuGyro(var_imu_w_);
+      } else if (name == "var_imu_acc") {
+        var_imu_acc_ = parameter.as_double();
+        ekf_.setVarImuAcc(var_imu_acc_);
+      } else if (name == "var_gnss_xy") {
+        var_gnss_xy_ = parameter.as_double();
+        var_gnss_ << var_gnss_xy_, var_gnss_xy_, var_gnss_z_;
+      } else if (name == "var_gnss_z") {
+        var_gnss_z_ = parameter.as_double();
+        var_gnss_ << var_gnss_xy_, var_gnss_xy_, var_gnss_z_;
+      } else if (name == "var_odom_xyz") {
+        var_odom_xyz_ = parameter.as_double();
+        var_odom_ << var_odom_xyz_, var_odom_xyz_, var_odom_xyz_;
+      } else if (name == "use_gnss") {
+        use_gnss_ = parameter.as_bool();
+      } else if (name == "use_odom") {
+        use_odom_ = parameter.as_bool();
+      } else if (name == "publish_imu_decimation") {
+        publish_imu_decimation_ = static_cast<int>(parameter.as_int());
+      } else if (name == "pub_period") {
+        pub_period_ = static_cast<int>(parameter.as_int());
+        restart_timer = true;
+      } else {
+        RCLCPP_INFO_STREAM(get_logger(), name << " takes effect on the next configure.");
+      }
+    }
+  }
+  // timer_ only exists while active in timer mode; the lifecycle transitions run in the
+  // same (default) callback group as the parameter services, so they do not race with this
+  if (restart_timer && timer_) {
+    timer_ = create_wall_timer(
+      std::chrono::milliseconds(pub_period_),
+      std::bind(&EkfLocalizationComponent::broadcastPose, this), output_callback_group_);
+  }
+  return result;
+}
+
+EkfLocalizationComponent::CallbackReturn EkfLocalizationComponent::on_configure(
+  const rclcpp_lifecycle::State &)
+{
+  get_parameter("reference_frame_id", reference_frame_id_);
+  get_parameter("robot_frame_id", robot_frame_id_);
+  get_parameter("initial_pose_topic", initial_pose_topic_);
+  get_parameter("imu_topic", imu_topic_);
+  get_parameter("odom_topic", odom_topic_);
+  get_parameter("gnss_pose_topic", gnss_pose_topic_);
+  get_parameter("navsat_fix_topic", navsat_fix_topic_);
+  get_parameter("pub_period", pub_period_);
+  get_parameter("publish_mode", publish_mode_);
+  get_parameter("publish_imu_decimation", publish_imu_decimation_);
+  get_parameter("publish_latency", publish_latency_);
+  get_parameter("extrapolate_to_publish_time", extrapolate_to_publish_time_);
+  get_parameter("max_extrapolation_horizon", max_extrapolation_horizon_);
+  get_parameter("var_imu_w", var_imu_w_);
+  get_parameter("var_imu_acc", var_imu_acc_);
+  get_parameter("var_gnss_xy", var_gnss_xy_);
+  get_parameter("var_gnss_z", var_gnss_z_);
+  get_parameter("var_odom_xyz", var_odom_xyz_);
+  use_gnss_ = get_parameter("use_gnss").as_bool();
+  use_odom_ = get_parameter("use_odom").as_bool();
+  get_parameter("use_gnss_as_initial_pose", use_gnss_as_initial_pose_);
+  get_parameter("use_navsat_fix", use_navsat_fix_);
+  get_parameter("navsat_origin", navsat_origin_);
+  // the map origin is fixed here (or by the first fix) until the next cleanup
+  local_cartesian_.reset();
+  if (navsat_origin_.size() == 3) {
+    local_cartesian_.setOrigin(navsat_origin_[0], navsat_origin_[1], navsat_origin_[2]);
+  } else if (!navsat_origin_.empty()) {
+    RCLCPP_WARN_STREAM(
+      get_logger(), "navsat_origin needs [latitude, longitude, altitude], use the first fix.");
+  }
   get_parameter("broadcast_tf_topic", broadcast_tf_topic_);
+  get_parameter("use_square_root_filter", use_square_root_filter_);
+  get_parameter("preintegration_batch_size", preintegration_batch_size_);
+  get_parameter("history_capacity", history_capacity_);
+  get_parameter("use_static_imu_extrinsic", use_static_imu_extrinsic_);
+  get_parameter("real_time_mode", real_time_mode_);
+  get_parameter("thread_priority", thread_priority_);
+  get_parameter("cpu_affinity", cpu_affinity_);
+  get_parameter("fusion_queue_capacity", fusion_queue_capacity_);
+  get_parameter("fusion_reorder_window", fusion_reorder_window_);
+  get_parameter("publish_diagnostics", publish_diagnostics_);
+  get_parameter("checkpoint_path", checkpoint_path_);
+  get_parameter("checkpoint_period", checkpoint_period_);
+  get_parameter("max_checkpoint_age", max_checkpoint_age_);
 
+  // a fresh filter on every configure; activation restores the checkpoint, if any
+  ekf_ = Estimator(
+    use_square_root_filter_ ? Estimator::CovarianceForm::SQUARE_ROOT :
+    Estimator::CovarianceForm::DENSE);
+  ekf_.setPreintegrationBatchSize(preintegration_batch_size_);
+  ekf_.setHistoryCapacity(static_cast<size_t>(std::max(history_capacity_, 0)));
   ekf_.setVarImuGyro(var_imu_w_);
   ekf_.setVarImuAcc(var_imu_acc_);
   var_gnss_ << var_gnss_xy_, var_gnss_xy_, var_gnss_z_;
   var_odom_ << var_odom_xyz_, var_odom_xyz_, var_odom_xyz_;
+  fusion_queue_capacity_ = std::max(fusion_queue_capacity_, 1);
+  fusion_queue_.reset(
+    static_cast<size_t>(fusion_queue_capacity_),
+    static_cast<int64_t>(fusion_reorder_window_ * 1e9));
+
+  if (real_time_mode_ && !lockMemory()) {
+    RCLCPP_WARN_STREAM(get_logger(), "mlockall failed, memory is not locked.");
+  }
 
   // Setup Publisher
+  // Real-time mode publishes the preallocated messages by reference, which intra-process
+  // comms would copy into a new message on every publish, so it is off for these publishers.
+  rclcpp::PublisherOptions publisher_options;
+  if (real_time_mode_) {
+    publisher_options.use_intra_process_comm = rclcpp::IntraProcessSetting::Disable;
+  }
   std::string output_pose_name = get_name() + std::string("/current_pose");
-  current_pose_pub_ = create_publisher<geometry_msgs::msg::PoseStamped>(output_pose_name, 10);
-
-  // Setup Subscriber
-  auto initial_pose_callback =
-    [this](const geometry_msgs::msg::PoseStamped::SharedPtr msg) -> void {
+  current_pose_pub_ = create_publisher<geometry_msgs::msg::PoseStamped>(
+    output_pose_name, 10, publisher_options);
+  pose_with_covariance_pub_ = create_publisher<geometry_msgs::msg::PoseWithCovarianceStamped>(
+    get_name() + std::string("/current_pose_with_covariance"), 10, publisher_options);
+  odometry_pub_ = create_publisher<nav_msgs::msg::Odometry>(
+    get_name() + std::string("/odometry"), 10, publisher_options);
+  if (publish_latency_) {
+    latency_pub_ = create_publisher<std_msgs::msg::Float64>(
+      get_name() + std::string("/latency"), 10, publisher_options);
+  }
+  if (broadcast_tf_topic_) {
+    // what tf2_ros::TransformBroadcaster publishes, without its vector and message per call
+    tf_pub_ = create_publisher<tf2_msgs::msg::TFMessage>(
+      "/tf", tf2_ros::DynamicBroadcasterQoS(), publisher_options);
+  }
+  if (publish_diagnostics_) {
+    diagnostics_pub_ = create_publisher<diagnostic_msgs::msg::DiagnosticArray>("/diagnostics", 10);
+  }
 
-  };
+  // The imu, the gnss/odom and the output paths run in their own callback groups, so a
+  // slow tf lookup does not hold back measurements or publishing on a multi-threaded
+  // executor. filter_mutex_ serializes the filter itself.
+  imu_callback_group_ = create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  measurement_callback_group_ =
+    create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  output_callback_group_ = create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  rclcpp::SubscriptionOptions imu_options;
+  imu_options.callback_group = imu_callback_group_;
+  rclcpp::SubscriptionOptions measurement_options;
+  measurement_options.callback_group = measurement_callback_group_;
 
-  auto imu_callback = [this](const sensor_msgs::msg::Imu::SharedPtr msg) -> void {
-    if (initial_pose_) {
-      sensor_msgs::msg::Imu transformed_msg;
+  // Setup Subscriber
+  // the sensor callbacks ignore their input while the node is not active
+  auto imu_callback = [this](const sensor_msgs::msg::Imu::ConstSharedPtr msg) -> void {
+    const LatencyHistogram::Scope scope(imu_callback_time_);
+    KFL_TRACEPOINT(
+      imu_received, trace_node_handle_, rclcpp::Time(msg->header.stamp).nanoseconds());
+    ++num_imu_messages_;
+    if (activated_ && initialized_) {
       try {
-        geometry_msgs::msg::Vector3Stamped acc_in, acc_out, w_in, w_out;
-        acc_in.vector.x = msg->linear_acceleration.x;
-        acc_in.vector.y = msg->linear_acceleration.y;
-        acc_in.vector.z = msg->linear_acceleration.z;
-        w_in.vector.x = msg->angular_velocity.x;
-        w_in.vector.y = msg->angular_velocity.y;
-        w_in.vector.z = msg->angular_velocity.z;
-        tf2::TimePoint time_point = tf2::TimePoint(
-          std::chrono::seconds(msg->header.stamp.sec) +
-          std::chrono::nanoseconds(msg->header.stamp.nanosec));
-        const geometry_msgs::msg::TransformStamped transform = tfbuffer_.lookupTransform(
-          robot_frame_id_, msg->header.frame_id, time_point, tf2::durationFromSec(1.0));
-        tf2::doTransform(acc_in, acc_out, transform);
-        tf2::doTransform(w_in, w_out, transform);
-        transformed_msg.header.stamp = msg->header.stamp;
-        transformed_msg.angular_velocity.x = w_out.vector.x;
-        transformed_msg.angular_velocity.y = w_out.vector.y;
-        transformed_msg.angular_velocity.z = w_out.vector.z;
-        transformed_msg.linear_acceleration.x = acc_out.vector.x;
-        transformed_msg.linear_acceleration.y = acc_out.vector.y;
-        transformed_msg.linear_acceleration.z = acc_out.vector.z;
-        predictUpdate(transformed_msg);
+        Eigen::Matrix3d imu_rotation;
+        if (use_static_imu_extrinsic_) {
+          if (!imu_rotation_ || imu_frame_id_ != msg->header.frame_id) {
+            const geometry_msgs::msg::TransformStamped transform = tfbuffer_.lookupTransform(
+              robot_frame_id_, msg->header.frame_id, tf2::TimePointZero,
+              tf2::durationFromSec(1.0));
+            imu_rotation_ = tf2::transformToEigen(transform).linear();
+            imu_frame_id_ = msg->header.frame_id;
+          }
+          imu_rotation = *imu_rotation_;
+        } else {
+          tf2::TimePoint time_point = tf2::TimePoint(
+            std::chrono::seconds(msg->header.stamp.sec) +
+            std::chrono::nanoseconds(msg->header.stamp.nanosec));
+          const geometry_msgs::msg::TransformStamped transform = tfbuffer_.lookupTransform(
+            robot_frame_id_, msg->header.frame_id, time_point, tf2::durationFromSec(1.0));
+          imu_rotation = tf2::transformToEigen(transform).linear();
+        }
+        const Eigen::Vector3d gyro = imu_rotation * Eigen::Vector3d(
+          msg->angular_velocity.x, msg->angular_velocity.y, msg->angular_velocity.z);
+        const Eigen::Vector3d linear_acceleration = imu_rotation * Eigen::Vector3d(
+          msg->linear_acceleration.x, msg->linear_acceleration.y, msg->linear_acceleration.z);
+        KFL_TRACEPOINT(
+          imu_transformed, trace_node_handle_, rclcpp::Time(msg->header.stamp).nanoseconds());
+        enqueue(FusionItem{FusionItem::IMU, msg->header.stamp, gyro, linear_acceleration});
       } catch (tf2::TransformException & e) {
-        RCLCPP_ERROR(this->get_logger(), "%s", e.what());
+        ++num_tf_errors_;
+        RCLCPP_ERROR_THROTTLE(this->get_logger(), *get_clock(), 5000, "%s", e.what());
         return;
       } catch (std::runtime_error & e) {
-        RCLCPP_ERROR(this->get_logger(), "%s", e.what());
+        ++num_tf_errors_;
+        RCLCPP_ERROR_THROTTLE(this->get_logger(), *get_clock(), 5000, "%s", e.what());
         return;
       }
     }
   };
 
-  auto odom_callback = [this](const nav_msgs::msg::Odometry::SharedPtr msg) -> void {
-    if (initial_pose_ && use_odom_) {
+  // a new static transform may change the imu extrinsic, look it up again on the next imu
+  // message. The TransformListener fills tfbuffer_ from its own /tf_static subscription on
+  // another thread, so the transforms are inserted here as well: otherwise the next imu
+  // message could cache the old extrinsic again before the listener has the new one.
+  auto tf_static_callback = [this](const tf2_msgs::msg::TFMessage::ConstSharedPtr msg) -> void {
+    for (const geometry_msgs::msg::TransformStamped & transform : msg->transforms) {
+      if (!tfbuffer_.setTransform(transform, get_name(), true)) {
+        ++num_tf_errors_;
+      }
+    }
+    imu_rotation_.reset();
+  };
+
+  auto odom_callback = [this](const nav_msgs::msg::Odometry::ConstSharedPtr msg) -> void {
+    const LatencyHistogram::Scope scope(odom_callback_time_);
+    KFL_TRACEPOINT(
+      odom_received, trace_node_handle_, rclcpp::Time(msg->header.stamp).nanoseconds());
+    ++num_odom_messages_;
+    if (!use_odom_) {
+      // start from the next message again once odom is switched back on
+      previous_odom_mat_ = Eigen::Matrix4d::Identity();
+      return;
+    }
+    if (activated_ && initialized_) {
       Eigen::Affine3d affine;
       tf2::fromMsg(msg->pose.pose, affine);
       Eigen::Matrix4d odom_mat = affine.matrix();
       if (previous_odom_mat_ == Eigen::Matrix4d::Identity()) {
-        current_pose_odom_ = current_pose_;
+        current_pose_odom_.pose = toPose(state_snapshot_.load());
         previous_odom_mat_ = odom_mat;
         return;
       }
@@ -147,112 +360,823 @@ EkfLocalizationComponent::EkfLocalizationComponent(const rclcpp::NodeOptions & o
       Eigen::Matrix4d current_trans = current_affine.matrix();
       current_trans = current_trans * previous_odom_mat_.inverse() * odom_mat;
 
-      geometry_msgs::msg::PoseStamped pose;
-      pose.header = msg->header;
-      pose.pose.position.x = current_trans(0, 3);
-      pose.pose.position.y = current_trans(1, 3);
-      pose.pose.position.z = current_trans(2, 3);
-      measurementUpdate(pose, var_odom_);
+      enqueue(
+        FusionItem{FusionItem::ODOM, msg->header.stamp, current_trans.block<3, 1>(0, 3),
+          Eigen::Vector3d::Zero()});
 
-      current_pose_odom_ = current_pose_;
+      current_pose_odom_.pose = toPose(state_snapshot_.load());
       previous_odom_mat_ = odom_mat;
     }
   };
 
-  auto gnss_pose_callback = [&](const geometry_msgs::msg::PoseStamped::SharedPtr msg) -> void {
-    if (use_gnss_as_initial_pose_ && !initial_pose_) {
+  auto gnss_pose_callback =
+    [this](const geometry_msgs::msg::PoseStamped::ConstSharedPtr msg) -> void {
+    const LatencyHistogram::Scope scope(gnss_callback_time_);
+    KFL_TRACEPOINT(
+      gnss_received, trace_node_handle_, rclcpp::Time(msg->header.stamp).nanoseconds());
+    ++num_gnss_messages_;
+    if (!activated_) {
+      return;
+    }
+    if (use_gnss_as_initial_pose_ && !initialized_) {
       initialPoseCallback(msg);
     } else {
-      if (initial_pose_ && use_gnss_) {
+      if (initialized_ && use_gnss_) {
         // RCLCPP_INFO_STREAM(get_logger(), "update measurement");
-        measurementUpdate(*msg, var_gnss_);
+        const Eigen::Vector3d y(
+          msg->pose.position.x, msg->pose.position.y, msg->pose.position.z);
+        enqueue(FusionItem{FusionItem::GNSS, msg->header.stamp, y, Eigen::Vector3d::Zero()});
+      }
+    }
+  };
+
+  auto navsat_fix_callback =
+    [this](const sensor_msgs::msg::NavSatFix::ConstSharedPtr msg) -> void {
+    const LatencyHistogram::Scope scope(gnss_callback_time_);
+    KFL_TRACEPOINT(
+      gnss_received, trace_node_handle_, rclcpp::Time(msg->header.stamp).nanoseconds());
+    ++num_gnss_messages_;
+    if (!activated_) {
+      return;
+    }
+    if (msg->status.status < sensor_msgs::msg::NavSatStatus::STATUS_FIX ||
+      !std::isfinite(msg->latitude) || !std::isfinite(msg->longitude) ||
+      !std::isfinite(msg->altitude))
+    {
+      ++num_dropped_measurements_;
+      return;
+    }
+    if (!local_cartesian_.hasOrigin()) {
+      local_cartesian_.setOrigin(msg->latitude, msg->longitude, msg->altitude);
+      RCLCPP_INFO_STREAM(
+        get_logger(), std::setprecision(10) << "navsat origin: " << msg->latitude << ", " <<
+          msg->longitude << ", " << msg->altitude);
+    }
+    const Eigen::Vector3d y =
+      local_cartesian_.forward(msg->latitude, msg->longitude, msg->altitude);
+    if (use_gnss_as_initial_pose_ && !initialized_) {
+      // a fix carries no attitude
+      auto pose = std::make_shared<geometry_msgs::msg::PoseStamped>();
+      pose->header.stamp = msg->header.stamp;
+      pose->header.frame_id = reference_frame_id_;
+      pose->pose.position.x = y.x();
+      pose->pose.position.y = y.y();
+      pose->pose.position.z = y.z();
+      initialPoseCallback(pose);
+    } else if (initialized_ && use_gnss_) {
+      // position_covariance is row major in east-north-up, the frame of y
+      typedef sensor_msgs::msg::NavSatFix NavSatFix;
+      FusionItem item{FusionItem::NAVSAT_FIX, msg->header.stamp, y, Eigen::Vector3d::Zero(),
+        Eigen::Matrix3d::Zero()};
+      if (msg->position_covariance_type == NavSatFix::COVARIANCE_TYPE_UNKNOWN) {
+        // var_gnss_xy/z
+        item.type = FusionItem::GNSS;
+      } else if (msg->position_covariance_type == NavSatFix::COVARIANCE_TYPE_DIAGONAL_KNOWN) {
+        // the variances take the sequential update, as var_gnss_ does
+        item.type = FusionItem::NAVSAT_FIX_DIAGONAL;
+        item.second << msg->position_covariance[0], msg->position_covariance[4],
+          msg->position_covariance[8];
+      } else {
+        item.covariance =
+          Eigen::Map<const Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>(
+          msg->position_covariance.data());
       }
+      enqueue(item);
     }
   };
 
   if (!use_gnss_as_initial_pose_) {
     sub_initial_pose_ = create_subscription<geometry_msgs::msg::PoseStamped>(
       initial_pose_topic_, 1,
-      std::bind(&EkfLocalizationComponent::initialPoseCallback, this, std::placeholders::_1));
-  }
-  sub_imu_ = create_subscription<sensor_msgs::msg::Imu>(imu_topic_, 1, imu_callback);
-  sub_odom_ = create_subscription<nav_msgs::msg::Odometry>(odom_topic_, 1, odom_callback);
-  sub_gnss_pose_ =
-    create_subscription<geometry_msgs::msg::PoseStamped>(gnss_pose_topic_, 1, gnss_pose_callback);
-  std::chrono::milliseconds period(pub_period_);
-  timer_ = create_wall_timer(
-    std::chrono::duration_cast<std::chrono::nanoseconds>(period),
-    std::bind(&EkfLocalizationComponent::broadcastPose, this));
+      std::bind(&EkfLocalizationComponent::initialPoseCallback, this, std::placeholders::_1),
+      measurement_options);
+  }
+  // deep enough for bursts, the fusion queue restores the time order
+  const size_t depth = static_cast<size_t>(fusion_queue_capacity_);
+  sub_imu_ =
+    create_subscription<sensor_msgs::msg::Imu>(imu_topic_, depth, imu_callback, imu_options);
+  if (use_static_imu_extrinsic_) {
+    // intra-process delivery does not support transient local durability
+    rclcpp::SubscriptionOptions tf_static_options = imu_options;
+    tf_static_options.use_intra_process_comm = rclcpp::IntraProcessSetting::Disable;
+    sub_tf_static_ = create_subscription<tf2_msgs::msg::TFMessage>(
+      "/tf_static", rclcpp::QoS(100).transient_local(), tf_static_callback, tf_static_options);
+  }
+  sub_odom_ = create_subscription<nav_msgs::msg::Odometry>(
+    odom_topic_, depth, odom_callback, measurement_options);
+  if (use_navsat_fix_) {
+    sub_navsat_fix_ = create_subscription<sensor_msgs::msg::NavSatFix>(
+      navsat_fix_topic_, depth, navsat_fix_callback, measurement_options);
+  } else {
+    sub_gnss_pose_ = create_subscription<geometry_msgs::msg::PoseStamped>(
+      gnss_pose_topic_, depth, gnss_pose_callback, measurement_options);
+  }
+  publish_on_event_ = publish_mode_ == "event";
+  if (!publish_on_event_ && publish_mode_ != "timer") {
+    RCLCPP_WARN_STREAM(
+      get_logger(), "unknown publish_mode " << publish_mode_ << ", use timer instead.");
+  }
+
+  // preallocated output, see broadcastPose
+  pose_msg_.header.frame_id = reference_frame_id_;
+  pose_with_covariance_msg_.header.frame_id = reference_frame_id_;
+  odometry_msg_.header.frame_id = reference_frame_id_;
+  odometry_msg_.child_frame_id = robot_frame_id_;
+  tf_msg_.transforms.resize(1);
+  tf_msg_.transforms[0].header.frame_id = reference_frame_id_;
+  tf_msg_.transforms[0].child_frame_id = robot_frame_id_;
+  return CallbackReturn::SUCCESS;
+}
+
+EkfLocalizationComponent::CallbackReturn EkfLocalizationComponent::on_activate(
+  const rclcpp_lifecycle::State &)
+{
+  current_pose_pub_->on_activate();
+  pose_with_covariance_pub_->on_activate();
+  odometry_pub_->on_activate();
+  if (latency_pub_) {
+    latency_pub_->on_activate();
+  }
+  if (tf_pub_) {
+    tf_pub_->on_activate();
+  }
+  if (diagnostics_pub_) {
+    diagnostics_pub_->on_activate();
+  }
+  reported_time_ = std::chrono::steady_clock::now();
+  if (!initialized_ && !checkpoint_path_.empty()) {
+    restoreCheckpoint();
+  }
+
+  if (!publish_on_event_) {
+    std::chrono::milliseconds period(pub_period_);
+    timer_ = create_wall_timer(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(period),
+      std::bind(&EkfLocalizationComponent::broadcastPose, this), output_callback_group_);
+  }
+  // the sensor and output paths only count problems, they are logged from here
+  status_timer_ = create_wall_timer(
+    std::chrono::seconds(1), std::bind(&EkfLocalizationComponent::reportStatus, this),
+    output_callback_group_);
+  if (!checkpoint_path_.empty() && checkpoint_period_ > 0) {
+    checkpoint_timer_ = create_wall_timer(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::duration<double>(checkpoint_period_)),
+      std::bind(&EkfLocalizationComponent::writeCheckpoint, this), output_callback_group_);
+  }
+  activated_ = true;
+  return CallbackReturn::SUCCESS;
+}
+
+EkfLocalizationComponent::CallbackReturn EkfLocalizationComponent::on_deactivate(
+  const rclcpp_lifecycle::State &)
+{
+  activated_ = false;
+  timer_.reset();
+  status_timer_.reset();
+  checkpoint_timer_.reset();
+  if (!checkpoint_path_.empty()) {
+    writeCheckpoint();
+  }
+  current_pose_pub_->on_deactivate();
+  pose_with_covariance_pub_->on_deactivate();
+  odometry_pub_->on_deactivate();
+  if (latency_pub_) {
+    latency_pub_->on_deactivate();
+  }
+  if (tf_pub_) {
+    tf_pub_->on_deactivate();
+  }
+  if (diagnostics_pub_) {
+    diagnostics_pub_->on_deactivate();
+  }
+  return CallbackReturn::SUCCESS;
+}
+
+EkfLocalizationComponent::CallbackReturn EkfLocalizationComponent::on_cleanup(
+  const rclcpp_lifecycle::State &)
+{
+  sub_initial_pose_.reset();
+  sub_imu_.reset();
+  sub_odom_.reset();
+  sub_gnss_pose_.reset();
+  sub_navsat_fix_.reset();
+  sub_tf_static_.reset();
+  current_pose_pub_.reset();
+  pose_with_covariance_pub_.reset();
+  odometry_pub_.reset();
+  latency_pub_.reset();
+  tf_pub_.reset();
+  diagnostics_pub_.reset();
+
+  // the state goes with the filter; a new configure starts uninitialized
+  std::lock_guard<std::mutex> lock(filter_mutex_);
+  initialized_ = false;
+  initial_pose_.reset();
+  imu_rotation_.reset();
+  previous_odom_mat_ = Eigen::Matrix4d::Identity();
+  local_cartesian_.reset();
+  last_checkpoint_stamp_ = 0;
+  // the filter and fusion queue counters restart with the next configure, these with it
+  num_dropped_measurements_ = 0;
+  num_tf_errors_ = 0;
+  num_uninitialized_publishes_ = 0;
+  num_imu_messages_ = 0;
+  num_gnss_messages_ = 0;
+  num_odom_messages_ = 0;
+  num_publishes_ = 0;
+  reported_counts_ = StatusCounts();
+  for (LatencyHistogram * histogram : {&imu_callback_time_, &gnss_callback_time_,
+      &odom_callback_time_, &broadcast_time_, &imu_latency_, &gnss_latency_, &odom_latency_,
+      &output_latency_})
+  {
+    histogram->drain();
+  }
+  return CallbackReturn::SUCCESS;
+}
+
+EkfLocalizationComponent::CallbackReturn EkfLocalizationComponent::on_shutdown(
+  const rclcpp_lifecycle::State & state)
+{
+  if (activated_) {
+    on_deactivate(state);
+  }
+  return CallbackReturn::SUCCESS;
+}
+
+void EkfLocalizationComponent::writeCheckpoint()
+{
+  // the checkpoint timer and on_deactivate may both get here, and both write path.tmp
+  std::lock_guard<std::mutex> checkpoint_lock(checkpoint_mutex_);
+  Checkpoint checkpoint;
+  {
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    if (!initialized_ || current_stamp_.nanoseconds() == last_checkpoint_stamp_) {
+      return;
+    }
+    last_checkpoint_stamp_ = current_stamp_.nanoseconds();
+    checkpoint.stamp_nanoseconds = last_checkpoint_stamp_;
+    Eigen::Map<Eigen::Matrix<double, 10, 1>>(checkpoint.x) = ekf_.getX().cast<double>();
+    Eigen::Map<Eigen::Matrix<double, 9, 9>>(checkpoint.covariance) =
+      ekf_.getCoveriance().cast<double>();
+    checkpoint.var_imu_w = var_imu_w_;
+    checkpoint.var_imu_acc = var_imu_acc_;
+  }
+  // outside filter_mutex_, the file system may block
+  if (!saveCheckpoint(checkpoint_path_, checkpoint)) {
+    RCLCPP_WARN_STREAM_THROTTLE(
+      get_logger(), *get_clock(), 10000, "failed to write checkpoint " << checkpoint_path_ << ".");
+  }
+}
+
+void EkfLocalizationComponent::restoreCheckpoint()
+{
+  Checkpoint checkpoint;
+  if (!loadCheckpoint(checkpoint_path_, checkpoint)) {
+    RCLCPP_INFO_STREAM(get_logger(), "no valid checkpoint at " << checkpoint_path_ << ".");
+    return;
+  }
+  const double age = (now().nanoseconds() - checkpoint.stamp_nanoseconds) * 1e-9;
+  if (std::abs(age) > max_checkpoint_age_) {
+    RCLCPP_INFO_STREAM(
+      get_logger(), "checkpoint is " << age << " sec old, wait for the initial pose.");
+    return;
+  }
+  std::lock_guard<std::mutex> lock(filter_mutex_);
+  if (checkpoint.var_imu_w != var_imu_w_ || checkpoint.var_imu_acc != var_imu_acc_) {
+    RCLCPP_WARN_STREAM(
+      get_logger(), "checkpoint was written with var_imu_w " << checkpoint.var_imu_w <<
+        " and var_imu_acc " << checkpoint.var_imu_acc << ", continuing with the parameters.");
+  }
+  // the hash only catches damage on disk, not a state that was already broken when saved
+  const Eigen::Map<const Eigen::Matrix<double, 10, 1>> x(checkpoint.x);
+  if (!x.allFinite() ||
+    !ekf_.setInitialCovariance(
+      Eigen::Map<const Eigen::Matrix<double, 9, 9>>(checkpoint.covariance)
+      .cast<Estimator::Scalar>()))
+  {
+    RCLCPP_WARN_STREAM(
+      get_logger(), "checkpoint at " << checkpoint_path_ << " has a non-finite state or a " <<
+        "covariance that is not positive definite, wait for the initial pose.");
+    return;
+  }
+  current_stamp_ = rclcpp::Time(checkpoint.stamp_nanoseconds, RCL_ROS_TIME);
+  last_imu_stamp_nanoseconds_ = checkpoint.stamp_nanoseconds;
+  ekf_.setInitialX(x.cast<Estimator::Scalar>());
+  last_checkpoint_stamp_ = checkpoint.stamp_nanoseconds;
+  storeStateSnapshot();
+  initialized_ = true;
+  RCLCPP_INFO_STREAM(get_logger(), "restored the checkpoint from " << age << " sec ago.");
+}
+
+void EkfLocalizationComponent::configureExecutorThread()
+{
+  // read here, since this may run before on_configure
+  get_parameter("thread_priority", thread_priority_);
+  get_parameter("cpu_affinity", cpu_affinity_);
+  if (thread_priority_ > 0 && !setThreadPriority(thread_priority_)) {
+    RCLCPP_WARN_STREAM(
+      get_logger(), "failed to set SCHED_FIFO priority " << thread_priority_ << ".");
+  }
+  if (!cpu_affinity_.empty() && !setThreadAffinity(cpu_affinity_)) {
+    RCLCPP_WARN_STREAM(get_logger(), "failed to set the cpu affinity.");
+  }
+}
+
+void EkfLocalizationComponent::reportStatus()
+{
+  StatusCounts counts;
+  size_t queue_depth;
+  size_t max_queue_depth;
+  {
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    counts.skipped_imu_samples = ekf_.getNumSkippedImuSamples();
+    counts.dropped_imu_samples = fusion_queue_.dropped();
+    queue_depth = fusion_queue_.size();
+    max_queue_depth = fusion_queue_.maxSize();
+  }
+  counts.dropped_measurements = num_dropped_measurements_;
+  counts.tf_errors = num_tf_errors_;
+  counts.uninitialized_publishes = num_uninitialized_publishes_;
+  counts.imu_messages = num_imu_messages_;
+  counts.gnss_messages = num_gnss_messages_;
+  counts.odom_messages = num_odom_messages_;
+  counts.publishes = num_publishes_;
+
+  if (counts.uninitialized_publishes > reported_counts_.uninitialized_publishes) {
+    RCLCPP_WARN_STREAM(get_logger(), "initial pose does not recieved.");
+  }
+  if (counts.skipped_imu_samples > reported_counts_.skipped_imu_samples) {
+    RCLCPP_WARN_STREAM(
+      get_logger(), "imu time interval is too large, " <<
+        counts.skipped_imu_samples - reported_counts_.skipped_imu_samples <<
+        " imu samples skipped.");
+  }
+  if (counts.dropped_imu_samples > reported_counts_.dropped_imu_samples) {
+    RCLCPP_WARN_STREAM(
+      get_logger(), counts.dropped_imu_samples - reported_counts_.dropped_imu_samples <<
+        " late imu samples dropped (queue depth: " << queue_depth <<
+        ", max queue depth: " << max_queue_depth << ").");
+  }
+  if (counts.dropped_measurements > reported_counts_.dropped_measurements) {
+    RCLCPP_WARN_STREAM(
+      get_logger(), counts.dropped_measurements - reported_counts_.dropped_measurements <<
+        " measurements older than the filter history dropped.");
+  }
+  if (counts.tf_errors > reported_counts_.tf_errors) {
+    RCLCPP_WARN_STREAM(
+      get_logger(), counts.tf_errors - reported_counts_.tf_errors <<
+        " imu samples without transform.");
+  }
+  if (diagnostics_pub_) {
+    publishDiagnostics(counts, queue_depth, max_queue_depth);
+  }
+  reported_counts_ = counts;
+}
+
+namespace
+{
+diagnostic_msgs::msg::KeyValue keyValue(const std::string & key, const std::string & value)
+{
+  diagnostic_msgs::msg::KeyValue key_value;
+  key_value.key = key;
+  key_value.value = value;
+  return key_value;
+}
+
+diagnostic_msgs::msg::KeyValue keyValue(const std::string & key, const double value)
+{
+  return keyValue(key, std::to_string(value));
+}
+
+diagnostic_msgs::msg::KeyValue keyValue(const std::string & key, const uint64_t value)
+{
+  return keyValue(key, std::to_string(value));
+}
+
+/* one status per histogram, in usec */
+diagnostic_msgs::msg::DiagnosticStatus toDiagnosticStatus(
+  const std::string & name, LatencyHistogram & histogram)
+{
+  const LatencyHistogram::Summary summary = histogram.drain();
+  diagnostic_msgs::msg::DiagnosticStatus status;
+  status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+  status.name = name;
+  status.message = "last interval [usec]";
+  status.values.push_back(keyValue("count", summary.count));
+  status.values.push_back(keyValue("mean", summary.mean * 1e-3));
+  status.values.push_back(keyValue("p50", summary.p50 * 1e-3));
+  status.values.push_back(keyValue("p90", summary.p90 * 1e-3));
+  status.values.push_back(keyValue("p99", summary.p99 * 1e-3));
+  status.values.push_back(keyValue("max", summary.max * 1e-3));
+  return status;
+}
+}  // namespace
+
+/*
+* Counters (rates over the last interval and totals) and the latency histograms, drained
+* here, so every report covers the interval since the previous one. Runs once a second
+* on the output path; the sensor and filter paths only pay for the atomic adds.
+*/
+void EkfLocalizationComponent::publishDiagnostics(
+  const StatusCounts & counts, const size_t queue_depth, const size_t max_queue_depth)
+{
+  const std::chrono::steady_clock::time_point report_time = std::chrono::steady_clock::now();
+  const double interval = std::chrono::duration<double>(report_time - reported_time_).count();
+  reported_time_ = report_time;
+  auto rate = [interval](const uint64_t count, const uint64_t reported_count) {
+      return interval > 0 ? (count - reported_count) / interval : 0.0;
+    };
+  const std::string prefix = get_name() + std::string(": ");
+
+  auto diagnostics = std::make_unique<diagnostic_msgs::msg::DiagnosticArray>();
+  diagnostics->header.stamp = now();
+  diagnostic_msgs::msg::DiagnosticStatus status;
+  status.name = prefix + "filter";
+  const bool dropping =
+    counts.dropped_imu_samples > reported_counts_.dropped_imu_samples ||
+    counts.dropped_measurements > reported_counts_.dropped_measurements ||
+    counts.skipped_imu_samples > reported_counts_.skipped_imu_samples ||
+    counts.tf_errors > reported_counts_.tf_errors;
+  if (!initialized_) {
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+    status.message = "waiting for the initial pose";
+  } else if (dropping) {
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+    status.message = "dropping input";
+  } else {
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+    status.message = "running";
+  }
+  status.values.push_back(
+    keyValue("imu rate", rate(counts.imu_messages, reported_counts_.imu_messages)));
+  status.values.push_back(
+    keyValue("gnss rate", rate(counts.gnss_messages, reported_counts_.gnss_messages)));
+  status.values.push_back(
+    keyValue("odom rate", rate(counts.odom_messages, reported_counts_.odom_messages)));
+  status.values.push_back(
+    keyValue("publish rate", rate(counts.publishes, reported_counts_.publishes)));
+  status.values.push_back(keyValue("imu messages", counts.imu_messages));
+  status.values.push_back(keyValue("gnss messages", counts.gnss_messages));
+  status.values.push_back(keyValue("odom messages", counts.odom_messages));
+  status.values.push_back(keyValue("publishes", counts.publishes));
+  status.values.push_back(keyValue("skipped imu samples", counts.skipped_imu_samples));
+  status.values.push_back(keyValue("dropped imu samples", counts.dropped_imu_samples));
+  status.values.push_back(keyValue("dropped measurements", counts.dropped_measurements));
+  status.values.push_back(keyValue("tf errors", counts.tf_errors));
+  status.values.push_back(keyValue("queue depth", static_cast<uint64_t>(queue_depth)));
+  status.values.push_back(keyValue("max queue depth", static_cast<uint64_t>(max_queue_depth)));
+  diagnostics->status.push_back(status);
+
+  diagnostics->status.push_back(
+    toDiagnosticStatus(prefix + "imu callback time", imu_callback_time_));
+  diagnostics->status.push_back(
+    toDiagnosticStatus(prefix + "gnss callback time", gnss_callback_time_));
+  diagnostics->status.push_back(
+    toDiagnosticStatus(prefix + "odom callback time", odom_callback_time_));
+  diagnostics->status.push_back(toDiagnosticStatus(prefix + "publish time", broadcast_time_));
+  diagnostics->status.push_back(toDiagnosticStatus(prefix + "imu latency", imu_latency_));
+  diagnostics->status.push_back(toDiagnosticStatus(prefix + "gnss latency", gnss_latency_));
+  diagnostics->status.push_back(toDiagnosticStatus(prefix + "odom latency", odom_latency_));
+  diagnostics->status.push_back(toDiagnosticStatus(prefix + "output latency", output_latency_));
+  diagnostics_pub_->publish(std::move(diagnostics));
 }
 
 void EkfLocalizationComponent::initialPoseCallback(
-  const geometry_msgs::msg::PoseStamped::SharedPtr msg)
+  const geometry_msgs::msg::PoseStamped::ConstSharedPtr msg)
 {
+  if (!activated_) {
+    return;
+  }
   RCLCPP_INFO_STREAM(get_logger(), "initial pose callback");
+  std::lock_guard<std::mutex> lock(filter_mutex_);
   initial_pose_ = *msg;
-  current_pose_ = *msg;
-
-  Eigen::VectorXd x = Eigen::VectorXd::Zero(ekf_.getNumState());
-  x(STATE::X) = current_pose_.pose.position.x;
-  x(STATE::Y) = current_pose_.pose.position.y;
-  x(STATE::Z) = current_pose_.pose.position.z;
-  x(STATE::QX) = current_pose_.pose.orientation.x;
-  x(STATE::QY) = current_pose_.pose.orientation.y;
-  x(STATE::QZ) = current_pose_.pose.orientation.z;
-  x(STATE::QW) = current_pose_.pose.orientation.w;
+  current_stamp_ = msg->header.stamp;
+  last_imu_stamp_nanoseconds_ = current_stamp_.nanoseconds();
+
+  Estimator::StateVector x = Estimator::StateVector::Zero();
+  x(STATE::X) = msg->pose.position.x;
+  x(STATE::Y) = msg->pose.position.y;
+  x(STATE::Z) = msg->pose.position.z;
+  x(STATE::QX) = msg->pose.orientation.x;
+  x(STATE::QY) = msg->pose.orientation.y;
+  x(STATE::QZ) = msg->pose.orientation.z;
+  x(STATE::QW) = msg->pose.orientation.w;
   ekf_.setInitialX(x);
+  storeStateSnapshot();
+  initialized_ = true;
 }
 
-void EkfLocalizationComponent::predictUpdate(const sensor_msgs::msg::Imu imu_msg)
+void EkfLocalizationComponent::enqueue(const FusionItem & item)
 {
-  current_stamp_ = imu_msg.header.stamp;
+  const int64_t now_nanoseconds = now().nanoseconds();
+  bool publish = false;
+  {
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    const int64_t stamp = rclcpp::Time(item.stamp).nanoseconds();
+    if (item.type != FusionItem::IMU && fusion_queue_.late(stamp)) {
+      // behind the drained imu samples, left to the filter history
+      processFusionItem(item, now_nanoseconds);
+    } else {
+      if (fusion_queue_.full()) {
+        processFusionItem(fusion_queue_.pop(), now_nanoseconds);
+      }
+      // a rejected (late) imu sample is counted by the queue
+      fusion_queue_.push(stamp, item);
+      while (fusion_queue_.ready()) {
+        processFusionItem(fusion_queue_.pop(), now_nanoseconds);
+      }
+    }
+    publish = publish_pending_;
+    publish_pending_ = false;
+  }
+  // event mode: the new state is in state_snapshot_, so the output is published without
+  // holding up the filter
+  if (publish) {
+    broadcastPose();
+  }
+}
 
-  double current_time_imu = imu_msg.header.stamp.sec + imu_msg.header.stamp.nanosec * 1e-9;
-  Eigen::Vector3d gyro = Eigen::Vector3d(
-    imu_msg.angular_velocity.x, imu_msg.angular_velocity.y, imu_msg.angular_velocity.z);
-  Eigen::Vector3d linear_acceleration = Eigen::Vector3d(
-    imu_msg.linear_acceleration.x, imu_msg.linear_acceleration.y, imu_msg.linear_acceleration.z);
+void EkfLocalizationComponent::processFusionItem(
+  const FusionItem & item, const int64_t now_nanoseconds)
+{
+  const int64_t latency = now_nanoseconds - rclcpp::Time(item.stamp).nanoseconds();
+  if (item.type == FusionItem::IMU) {
+    imu_latency_.record(latency);
+  } else if (item.type != FusionItem::ODOM) {
+    gnss_latency_.record(latency);
+  } else {
+    odom_latency_.record(latency);
+  }
+  if (item.type == FusionItem::IMU) {
+    predictUpdate(item.stamp, item.first, item.second);
+  } else if (item.type == FusionItem::NAVSAT_FIX) {
+    measurementUpdate(item.stamp, item.first, item.covariance);
+  } else if (item.type == FusionItem::NAVSAT_FIX_DIAGONAL) {
+    measurementUpdate(item.stamp, item.first, item.second);
+  } else {
+    // the variance is looked up here, under filter_mutex_, so it can change at runtime
+    measurementUpdate(
+      item.stamp, item.first, item.type == FusionItem::GNSS ? var_gnss_ : var_odom_);
+  }
+}
+
+void EkfLocalizationComponent::predictUpdate(
+  const builtin_interfaces::msg::Time & stamp, const Eigen::Vector3d & gyro,
+  const Eigen::Vector3d & linear_acceleration)
+{
+  current_stamp_ = stamp;
+  last_imu_stamp_nanoseconds_ = current_stamp_.nanoseconds();
+  last_gyro_ = gyro;
+  last_linear_acceleration_ = linear_acceleration;
+
+  double current_time_imu = stamp.sec + stamp.nanosec * 1e-9;
+  KFL_TRACEPOINT(prediction_start, trace_node_handle_, rclcpp::Time(stamp).nanoseconds());
+  ekf_.predictionUpdate(
+    current_time_imu, gyro.cast<Estimator::Scalar>(),
+    linear_acceleration.cast<Estimator::Scalar>());
+  KFL_TRACEPOINT(prediction_end, trace_node_handle_, rclcpp::Time(stamp).nanoseconds());
+  storeStateSnapshot();
+
+  if (publish_on_event_ && ++imu_count_since_publish_ >= publish_imu_decimation_) {
+    imu_count_since_publish_ = 0;
+    publish_pending_ = true;
+  }
+}
+
+namespace
+{
+/* variances take the filter's diagonal (sequential) update, a full covariance the joint one */
+template<typename EstimatorT>
+bool observationUpdate(
+  EstimatorT & ekf, const double stamp, const Eigen::Vector3d & y,
+  const Eigen::Vector3d & variance)
+{
+  typedef typename EstimatorT::Scalar Scalar;
+  return ekf.observationUpdateDiagonal(stamp, y.cast<Scalar>(), variance.cast<Scalar>());
+}
 
-  ekf_.predictionUpdate(current_time_imu, gyro, linear_acceleration);
+template<typename EstimatorT>
+bool observationUpdate(
+  EstimatorT & ekf, const double stamp, const Eigen::Vector3d & y,
+  const Eigen::Matrix3d & covariance)
+{
+  typedef typename EstimatorT::Scalar Scalar;
+  return ekf.observationUpdate(stamp, y.cast<Scalar>(), covariance.cast<Scalar>());
 }
+}  // namespace
 
+template<typename CovarianceT>
 void EkfLocalizationComponent::measurementUpdate(
-  const geometry_msgs::msg::PoseStamped pose_msg, const Eigen::Vector3d variance)
+  const builtin_interfaces::msg::Time & stamp, const Eigen::Vector3d & y,
+  const CovarianceT & covariance)
+{
+  if (rclcpp::Time(stamp).nanoseconds() > current_stamp_.nanoseconds()) {
+    current_stamp_ = stamp;
+  }
+  double current_time = stamp.sec + stamp.nanosec * 1e-9;
+
+  KFL_TRACEPOINT(observation_start, trace_node_handle_, rclcpp::Time(stamp).nanoseconds());
+  const bool applied = observationUpdate(ekf_, current_time, y, covariance);
+  KFL_TRACEPOINT(observation_end, trace_node_handle_, rclcpp::Time(stamp).nanoseconds());
+  if (!applied) {
+    ++num_dropped_measurements_;
+    return;
+  }
+  storeStateSnapshot();
+
+  if (publish_on_event_) {
+    publish_pending_ = true;
+  }
+}
+
+void EkfLocalizationComponent::storeStateSnapshot()
+{
+  StateSnapshot snapshot;
+  snapshot.stamp_nanoseconds = current_stamp_.nanoseconds();
+  snapshot.imu_stamp_nanoseconds = last_imu_stamp_nanoseconds_;
+  const auto & x = ekf_.getX();
+  for (int i = 0; i < Estimator::num_state_; ++i) {
+    snapshot.x[i] = x(i);
+  }
+  for (int i = 0; i < 3; ++i) {
+    snapshot.gyro[i] = last_gyro_(i);
+    snapshot.linear_acceleration[i] = last_linear_acceleration_(i);
+  }
+  snapshot.var_imu_w = var_imu_w_;
+  // getCoveriance flushes the preintegration (and forms S S^T in square root form),
+  // so it is only paid for while someone listens
+  snapshot.has_covariance = store_covariance_;
+  if (snapshot.has_covariance) {
+    Eigen::Map<Eigen::Matrix<double, 9, 9>>(snapshot.covariance) =
+      ekf_.getCoveriance().cast<double>();
+  }
+  state_snapshot_.store(snapshot);
+}
+
+geometry_msgs::msg::Pose EkfLocalizationComponent::toPose(const StateSnapshot & snapshot)
+{
+  geometry_msgs::msg::Pose pose;
+  pose.position.x = snapshot.x[STATE::X];
+  pose.position.y = snapshot.x[STATE::Y];
+  pose.position.z = snapshot.x[STATE::Z];
+  pose.orientation.x = snapshot.x[STATE::QX];
+  pose.orientation.y = snapshot.x[STATE::QY];
+  pose.orientation.z = snapshot.x[STATE::QZ];
+  pose.orientation.w = snapshot.x[STATE::QW];
+  return pose;
+}
+
+/*
+* pose covariance in the ROS layout [x y z rot_x rot_y rot_z] (row major) from the error
+* state covariance, whose position and attitude blocks are dx[0:3] and dx[6:9]
+*/
+void EkfLocalizationComponent::toPoseCovariance(
+  const StateSnapshot & snapshot, std::array<double, 36> & covariance)
+{
+  const Eigen::Map<const Eigen::Matrix<double, 9, 9>> P(snapshot.covariance);
+  const int error_index[6] = {0, 1, 2, 6, 7, 8};
+  for (int i = 0; i < 6; ++i) {
+    for (int j = 0; j < 6; ++j) {
+      covariance[6 * i + j] = P(error_index[i], error_index[j]);
+    }
+  }
+}
+
+/*
+* pose (with covariance) in reference_frame_id and twist in robot_frame_id: the velocity
+* state and its covariance rotated into the body, and the last gyro sample with var_imu_w
+*/
+void EkfLocalizationComponent::toOdometry(
+  const StateSnapshot & snapshot, nav_msgs::msg::Odometry & odometry) const
 {
-  current_stamp_ = pose_msg.header.stamp;
-  Eigen::Vector3d y =
-    Eigen::Vector3d(pose_msg.pose.position.x, pose_msg.pose.position.y, pose_msg.pose.position.z);
+  odometry.header.stamp = rclcpp::Time(snapshot.stamp_nanoseconds, RCL_ROS_TIME);
+  odometry.header.frame_id = reference_frame_id_;
+  odometry.child_frame_id = robot_frame_id_;
+  odometry.pose.pose = toPose(snapshot);
+  toPoseCovariance(snapshot, odometry.pose.covariance);
 
-  ekf_.observationUpdate(y, variance);
+  const Eigen::Matrix3d rotation = Eigen::Quaterniond(
+    snapshot.x[STATE::QW], snapshot.x[STATE::QX], snapshot.x[STATE::QY],
+    snapshot.x[STATE::QZ]).toRotationMatrix();
+  const Eigen::Vector3d velocity =
+    rotation.transpose() * Eigen::Map<const Eigen::Vector3d>(snapshot.x + STATE::VX);
+  const Eigen::Map<const Eigen::Matrix<double, 9, 9>> P(snapshot.covariance);
+  const Eigen::Matrix3d velocity_covariance =
+    rotation.transpose() * P.block<3, 3>(3, 3) * rotation;
+  odometry.twist.twist.linear.x = velocity.x();
+  odometry.twist.twist.linear.y = velocity.y();
+  odometry.twist.twist.linear.z = velocity.z();
+  odometry.twist.twist.angular.x = snapshot.gyro[0];
+  odometry.twist.twist.angular.y = snapshot.gyro[1];
+  odometry.twist.twist.angular.z = snapshot.gyro[2];
+  std::array<double, 36> & twist_covariance = odometry.twist.covariance;
+  twist_covariance.fill(0.0);
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      twist_covariance[6 * i + j] = velocity_covariance(i, j);
+    }
+    twist_covariance[6 * (i + 3) + i + 3] = snapshot.var_imu_w;
+  }
+}
+
+void EkfLocalizationComponent::extrapolate(
+  StateSnapshot & snapshot, const int64_t target_nanoseconds) const
+{
+  const int64_t horizon = static_cast<int64_t>(max_extrapolation_horizon_ * 1e9);
+  // the state is at the last imu sample; a newer gnss/odom stamp does not move it forward
+  const int64_t dt = std::min(target_nanoseconds - snapshot.imu_stamp_nanoseconds, horizon);
+  if (dt <= 0) {
+    return;
+  }
+  // mean only, with the rates of the last imu sample held constant
+  EKFEstimator::StateVector x = Eigen::Map<const EKFEstimator::StateVector>(snapshot.x);
+  EKFEstimator::predictMean(
+    x, Eigen::Map<const Eigen::Vector3d>(snapshot.gyro),
+    Eigen::Map<const Eigen::Vector3d>(snapshot.linear_acceleration), dt * 1e-9);
+  Eigen::Map<EKFEstimator::StateVector>(snapshot.x) = x;
+  snapshot.stamp_nanoseconds = snapshot.imu_stamp_nanoseconds + dt;
 }
 
 void EkfLocalizationComponent::broadcastPose()
 {
-  if (initial_pose_) {
-    auto x = ekf_.getX();
-    current_pose_.header.stamp = current_stamp_;
-    current_pose_.header.frame_id = reference_frame_id_;
-    current_pose_.pose.position.x = x(STATE::X);
-    current_pose_.pose.position.y = x(STATE::Y);
-    current_pose_.pose.position.z = x(STATE::Z);
-    current_pose_.pose.orientation.x = x(STATE::QX);
-    current_pose_.pose.orientation.y = x(STATE::QY);
-    current_pose_.pose.orientation.z = x(STATE::QZ);
-    current_pose_.pose.orientation.w = x(STATE::QW);
-    current_pose_pub_->publish(current_pose_);
-    if (broadcast_tf_topic_) {
-      geometry_msgs::msg::TransformStamped transform_stamped;
-      transform_stamped.header.stamp = current_stamp_;
-      transform_stamped.header.frame_id = reference_frame_id_;
-      transform_stamped.child_frame_id = robot_frame_id_;
-      transform_stamped.transform.translation.x = current_pose_.pose.position.x;
-      transform_stamped.transform.translation.y = current_pose_.pose.position.y;
-      transform_stamped.transform.translation.z = current_pose_.pose.position.z;
-      transform_stamped.transform.rotation = current_pose_.pose.orientation;
-      broadcaster_.sendTransform(transform_stamped);
+  const LatencyHistogram::Scope scope(broadcast_time_);
+  // the latest snapshot is loaded under the lock, so the outputs stay in stamp order
+  std::lock_guard<std::mutex> lock(output_mutex_);
+  if (initialized_) {
+    // never waits for the filter, see storeStateSnapshot
+    StateSnapshot snapshot = state_snapshot_.load();
+    const int64_t now_nanoseconds = now().nanoseconds();
+    // newest sensor stamp in the state, before extrapolation moves the output stamp
+    const int64_t sensor_stamp_nanoseconds = snapshot.stamp_nanoseconds;
+    if (extrapolate_to_publish_time_) {
+      extrapolate(snapshot, now_nanoseconds);
+    }
+    const rclcpp::Time stamp(snapshot.stamp_nanoseconds, RCL_ROS_TIME);
+    const geometry_msgs::msg::Pose pose = toPose(snapshot);
+    // See publishMessage for where the messages live. output_mutex_ keeps the imu and the
+    // measurement callback groups, which both publish in event mode, off the preallocated
+    // members at the same time.
+    publishMessage(
+      *current_pose_pub_, pose_msg_,
+      [this, &pose, &stamp](geometry_msgs::msg::PoseStamped & msg) {
+        msg.header.stamp = stamp;
+        msg.header.frame_id = reference_frame_id_;
+        msg.pose = pose;
+      });
+    KFL_TRACEPOINT(pose_published, trace_node_handle_, snapshot.stamp_nanoseconds);
+    ++num_publishes_;
+    output_latency_.record(now_nanoseconds - sensor_stamp_nanoseconds);
+    if (latency_pub_) {
+      // age of the newest sensor stamp in the published state
+      const double latency = (now_nanoseconds - sensor_stamp_nanoseconds) * 1e-9;
+      publishMessage(
+        *latency_pub_, latency_msg_, [latency](std_msgs::msg::Float64 & msg) {
+          msg.data = latency;
+        });
+    }
+    if (tf_pub_) {
+      publishMessage(
+        *tf_pub_, tf_msg_, [this, &pose, &stamp](tf2_msgs::msg::TFMessage & msg) {
+          // no-op for tf_msg_, which keeps its one transform
+          msg.transforms.resize(1);
+          geometry_msgs::msg::TransformStamped & transform = msg.transforms[0];
+          transform.header.stamp = stamp;
+          transform.header.frame_id = reference_frame_id_;
+          transform.child_frame_id = robot_frame_id_;
+          transform.transform.translation.x = pose.position.x;
+          transform.transform.translation.y = pose.position.y;
+          transform.transform.translation.z = pose.position.z;
+          transform.transform.rotation = pose.orientation;
+        });
+    }
+
+    // the covariance outputs cost a getCoveriance per filter step, so they only run
+    // while subscribed; the snapshot carries the covariance from the next step on
+    const bool publish_pose_with_covariance = hasSubscribers(*pose_with_covariance_pub_);
+    const bool publish_odometry = hasSubscribers(*odometry_pub_);
+    store_covariance_ = publish_pose_with_covariance || publish_odometry;
+    if (!snapshot.has_covariance) {
+      return;
+    }
+    if (publish_pose_with_covariance) {
+      publishMessage(
+        *pose_with_covariance_pub_, pose_with_covariance_msg_,
+        [this, &snapshot, &pose, &stamp](geometry_msgs::msg::PoseWithCovarianceStamped & msg) {
+          msg.header.stamp = stamp;
+          msg.header.frame_id = reference_frame_id_;
+          msg.pose.pose = pose;
+          toPoseCovariance(snapshot, msg.pose.covariance);
+        });
+    }
+    if (publish_odometry) {
+      publishMessage(
+        *odometry_pub_, odometry_msg_, [this, &snapshot](nav_msgs::msg::Odometry & msg) {
+          toOdometry(snapshot, msg);
+        });
     }
   } else {
-    RCLCPP_WARN_STREAM(get_logger(), "initial pose does not recieved.");
+    ++num_uninitialized_publishes_;
   }
 }
 }  // namespace kalman_filter_localization
@@ -36,8 +36,14 @@ int main(int argc, char * argv[])
 {
   rclcpp::init(argc, argv);
   rclcpp::NodeOptions options;
+  options.use_intra_process_comms(true);
   auto component = std::make_shared<kalman_filter_localization::EkfLocalizationComponent>(options);
-  rclcpp::spin(component);
+  if (component->get_parameter("autostart").as_bool()) {
+    component->configure();
+    component->activate();
+  }
+  component->configureExecutorThread();
+  rclcpp::spin(component->get_node_base_interface());
   rclcpp::shutdown();
   return 0;
 }
@@ -0,0 +1,91 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include "allocation_counter.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+// per thread, so threads of the code under test (e.g. the tf listener) do not count
+thread_local uint64_t num_allocations = 0;
+}  // namespace
+
+/*
+* Counts operator new (the array and nothrow forms of the standard library call this one).
+* Eigen allocates dynamic matrices with malloc, so with glibc malloc is counted as well,
+* and operator new takes its memory from __libc_malloc to be counted once.
+*/
+#ifdef __GLIBC__
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * malloc(size_t size)
+{
+  ++num_allocations;
+  return __libc_malloc(size);
+}
+
+void * operator new(std::size_t size)
+{
+  void * pointer = __libc_malloc(size == 0 ? 1 : size);
+#else
+void * operator new(std::size_t size)
+{
+  void * pointer = std::malloc(size == 0 ? 1 : size);
+#endif
+  ++num_allocations;
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void operator delete(void * pointer) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void * pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+namespace kalman_filter_localization
+{
+namespace test
+{
+uint64_t numAllocations()
+{
+  return num_allocations;
+}
+}  // namespace test
+}  // namespace kalman_filter_localization
@@ -0,0 +1,96 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#ifndef TEST__EKF_TEST_STREAM_HPP_
+#define TEST__EKF_TEST_STREAM_HPP_
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cmath>
+
+namespace kalman_filter_localization
+{
+namespace test
+{
+constexpr double kImuPeriod = 0.005;
+
+/*
+* a deterministic IMU stream of a weaving, accelerating vehicle; the sample of step i
+* is stamped (i + 1) * kImuPeriod
+*/
+struct ImuSample
+{
+  double stamp;
+  Eigen::Vector3d gyro;
+  Eigen::Vector3d acc;
+};
+
+inline ImuSample imuSample(const int i)
+{
+  const double t = (i + 1) * kImuPeriod;
+  ImuSample sample;
+  sample.stamp = t;
+  sample.gyro << 0.1 * std::sin(0.5 * t), 0.05 * std::cos(0.3 * t), 0.2 * std::sin(0.1 * t);
+  sample.acc << 0.5 * std::cos(0.2 * t), 0.3 * std::sin(0.4 * t), 9.80665 + 0.1 * std::sin(t);
+  return sample;
+}
+
+/* a position observation at time t, not consistent with the IMU stream on purpose */
+inline Eigen::Vector3d positionObservation(const double t)
+{
+  return Eigen::Vector3d(2.0 * t, 0.5 * std::sin(t), 0.1 * t);
+}
+
+/* a fixed, fully populated symmetric positive definite covariance */
+inline Eigen::Matrix<double, 9, 9> initialCovariance()
+{
+  Eigen::Matrix<double, 9, 9> M;
+  for (int r = 0; r < 9; ++r) {
+    for (int c = 0; c < 9; ++c) {
+      M(r, c) = std::sin(1.0 + r * 9 + c);
+    }
+  }
+  return M * M.transpose() + Eigen::Matrix<double, 9, 9>::Identity();
+}
+
+/* relative difference of two matrices, scaled by the larger norm */
+template<typename DerivedA, typename DerivedB>
+double relativeError(const Eigen::MatrixBase<DerivedA> & a, const Eigen::MatrixBase<DerivedB> & b)
+{
+  const double scale = std::max(
+    static_cast<double>(a.norm()), std::max(static_cast<double>(b.norm()), 1e-12));
+  return static_cast<double>((a - b).norm()) / scale;
+}
+}  // namespace test
+}  // namespace kalman_filter_localization
+
+#endif  // TEST__EKF_TEST_STREAM_HPP_
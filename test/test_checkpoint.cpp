@@ -0,0 +1,204 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/checkpoint.hpp>
+#include <kalman_filter_localization/ekf.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "ekf_test_stream.hpp"
+
+namespace
+{
+using kalman_filter_localization::Checkpoint;
+using kalman_filter_localization::loadCheckpoint;
+using kalman_filter_localization::saveCheckpoint;
+
+// magic, format version and payload size, the payload, the hash
+constexpr size_t kPayloadOffset = 4 + 2 * sizeof(uint32_t);
+constexpr size_t kFileSize = kPayloadOffset + sizeof(Checkpoint) + sizeof(uint64_t);
+
+class CheckpointTest : public ::testing::Test
+{
+protected:
+  CheckpointTest()
+  : path_(::testing::TempDir() + "kfl_test_checkpoint.bin")
+  {
+    std::memset(&checkpoint_, 0, sizeof(checkpoint_));
+    checkpoint_.stamp_nanoseconds = 1234567890123456789;
+    for (int i = 0; i < 10; ++i) {
+      checkpoint_.x[i] = 0.1 * i - 0.3;
+    }
+    Eigen::Map<Eigen::Matrix<double, 9, 9>>(checkpoint_.covariance) =
+      kalman_filter_localization::test::initialCovariance();
+    checkpoint_.var_imu_w = 0.01;
+    checkpoint_.var_imu_acc = 0.02;
+  }
+
+  ~CheckpointTest() override
+  {
+    std::remove(path_.c_str());
+    std::remove((path_ + ".tmp").c_str());
+  }
+
+  std::vector<char> readFile() const
+  {
+    std::vector<char> bytes;
+    std::FILE * file = std::fopen(path_.c_str(), "rb");
+    if (file != nullptr) {
+      char buffer[256];
+      size_t size;
+      while ((size = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer + size);
+      }
+      std::fclose(file);
+    }
+    return bytes;
+  }
+
+  void writeFile(const std::vector<char> & bytes) const
+  {
+    std::FILE * file = std::fopen(path_.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(std::fwrite(bytes.data(), 1, bytes.size(), file), bytes.size());
+    std::fclose(file);
+  }
+
+  /* saves checkpoint_, lets modify change the file and expects the load to fail */
+  template<typename Modify>
+  void expectRejected(Modify modify)
+  {
+    ASSERT_TRUE(saveCheckpoint(path_, checkpoint_));
+    std::vector<char> bytes = readFile();
+    ASSERT_EQ(bytes.size(), kFileSize);
+    modify(bytes);
+    writeFile(bytes);
+
+    Checkpoint loaded;
+    std::memset(&loaded, 0x5a, sizeof(loaded));
+    const Checkpoint before = loaded;
+    EXPECT_FALSE(loadCheckpoint(path_, loaded));
+    // untouched on failure
+    EXPECT_EQ(std::memcmp(&loaded, &before, sizeof(Checkpoint)), 0);
+  }
+
+  std::string path_;
+  Checkpoint checkpoint_;
+};
+
+TEST_F(CheckpointTest, RoundTrip)
+{
+  ASSERT_TRUE(saveCheckpoint(path_, checkpoint_));
+  EXPECT_EQ(readFile().size(), kFileSize);
+  // the temporary file is renamed away
+  std::FILE * tmp_file = std::fopen((path_ + ".tmp").c_str(), "rb");
+  EXPECT_EQ(tmp_file, nullptr);
+  if (tmp_file != nullptr) {
+    std::fclose(tmp_file);
+  }
+
+  Checkpoint loaded;
+  ASSERT_TRUE(loadCheckpoint(path_, loaded));
+  EXPECT_EQ(std::memcmp(&loaded, &checkpoint_, sizeof(Checkpoint)), 0);
+
+  // a second save replaces the first
+  checkpoint_.x[0] = 42.0;
+  ASSERT_TRUE(saveCheckpoint(path_, checkpoint_));
+  ASSERT_TRUE(loadCheckpoint(path_, loaded));
+  EXPECT_EQ(loaded.x[0], 42.0);
+}
+
+TEST_F(CheckpointTest, MissingFile)
+{
+  Checkpoint loaded;
+  EXPECT_FALSE(loadCheckpoint(path_, loaded));
+  EXPECT_FALSE(saveCheckpoint(::testing::TempDir() + "missing/directory/checkpoint", checkpoint_));
+}
+
+TEST_F(CheckpointTest, CorruptPayload)
+{
+  // every byte of the payload and of the hash is covered by the hash
+  for (size_t offset = kPayloadOffset; offset < kFileSize; offset += 37) {
+    expectRejected([offset](std::vector<char> & bytes) {bytes[offset] ^= 0x10;});
+  }
+  expectRejected([](std::vector<char> & bytes) {bytes[kFileSize - 1] ^= 0x01;});
+}
+
+TEST_F(CheckpointTest, Truncated)
+{
+  for (const size_t size : {size_t{0}, size_t{3}, kPayloadOffset, kFileSize - 1}) {
+    expectRejected([size](std::vector<char> & bytes) {bytes.resize(size);});
+  }
+}
+
+TEST_F(CheckpointTest, WrongMagicOrVersion)
+{
+  expectRejected([](std::vector<char> & bytes) {bytes[0] = 'X';});
+  // format version 2
+  expectRejected([](std::vector<char> & bytes) {
+      const uint32_t version = 2;
+      std::memcpy(&bytes[4], &version, sizeof(version));
+    });
+  // payload size of another build
+  expectRejected([](std::vector<char> & bytes) {
+      const uint32_t size = sizeof(Checkpoint) + 8;
+      std::memcpy(&bytes[8], &size, sizeof(size));
+    });
+}
+
+/* what restoreCheckpoint relies on to reject a checkpoint of a broken state */
+TEST(EkfInitialCovarianceTest, RejectsCovarianceThatIsNotPositiveDefinite)
+{
+  for (const auto form : {EKFEstimator::CovarianceForm::DENSE,
+      EKFEstimator::CovarianceForm::SQUARE_ROOT})
+  {
+    EKFEstimator ekf(form);
+    const EKFEstimator::EigenMatrix9d P = kalman_filter_localization::test::initialCovariance();
+    ASSERT_TRUE(ekf.setInitialCovariance(P));
+
+    EKFEstimator::EigenMatrix9d indefinite = P;
+    indefinite(4, 4) = -1.0;
+    EXPECT_FALSE(ekf.setInitialCovariance(indefinite));
+    EKFEstimator::EigenMatrix9d not_finite = P;
+    not_finite(2, 7) = not_finite(7, 2) = std::numeric_limits<double>::quiet_NaN();
+    EXPECT_FALSE(ekf.setInitialCovariance(not_finite));
+
+    EXPECT_TRUE(ekf.getCoveriance().isApprox(P));
+  }
+}
+}  // namespace
@@ -0,0 +1,168 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf_localization_component.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "allocation_counter.hpp"
+
+namespace kalman_filter_localization
+{
+/*
+* Feeds imu, gnss and odom messages through the node's own subscriptions (handle_message
+* is what the executor calls after taking a message) in real-time mode, and counts the
+* heap allocations of the callbacks and the publish path once the node is warmed up.
+*/
+class EkfLocalizationComponentTest : public ::testing::Test
+{
+protected:
+  static void SetUpTestCase()
+  {
+    rclcpp::init(0, nullptr);
+  }
+
+  static void TearDownTestCase()
+  {
+    rclcpp::shutdown();
+  }
+
+  void TearDown() override
+  {
+    component_.reset();
+  }
+
+  void start(const std::string & publish_mode)
+  {
+    rclcpp::NodeOptions options;
+    options.use_intra_process_comms(true);
+    options.parameter_overrides(
+    {
+      {"real_time_mode", true},
+      {"publish_mode", publish_mode},
+      {"use_static_imu_extrinsic", true},
+      {"use_odom", true},
+      {"history_capacity", 100},
+      {"extrapolate_to_publish_time", true},
+      {"publish_latency", true},
+      {"publish_diagnostics", false},
+    });
+    component_ = std::make_shared<EkfLocalizationComponent>(options);
+    component_->configure();
+    component_->activate();
+
+    geometry_msgs::msg::TransformStamped imu_extrinsic;
+    imu_extrinsic.header.frame_id = "base_link";
+    imu_extrinsic.child_frame_id = "imu_link";
+    imu_extrinsic.transform.rotation.w = 1.0;
+    component_->tfbuffer_.setTransform(imu_extrinsic, "test", true);
+
+    auto initial_pose = std::make_shared<geometry_msgs::msg::PoseStamped>();
+    initial_pose->header.frame_id = "map";
+    initial_pose->pose.orientation.w = 1.0;
+    component_->initialPoseCallback(initial_pose);
+
+    imu_->header.frame_id = "imu_link";
+    imu_->linear_acceleration.z = 9.80665;
+    imu_->angular_velocity.z = 0.1;
+    gnss_->header.frame_id = "map";
+    odom_->header.frame_id = "odom";
+    odom_->pose.pose.orientation.w = 1.0;
+  }
+
+  /* one 200 Hz imu sample, gnss at 10 Hz and odom at 20 Hz arriving one imu sample late */
+  void step(const int i)
+  {
+    const builtin_interfaces::msg::Time stamp = rclcpp::Time(kPeriod * (i + 1));
+    imu_->header.stamp = stamp;
+    deliver(component_->sub_imu_, imu_);
+    if (i % 20 == 0) {
+      gnss_->header.stamp = stamp;
+      gnss_->pose.position.x = 1e-3 * i;
+      deliver(component_->sub_gnss_pose_, gnss_);
+    }
+    if (i % 10 == 5) {
+      odom_->header.stamp = rclcpp::Time(kPeriod * i);
+      odom_->pose.pose.position.x = 1e-3 * i;
+      deliver(component_->sub_odom_, odom_);
+    }
+    if (!component_->publish_on_event_ && i % 2 == 0) {
+      // what the publish timer runs
+      component_->broadcastPose();
+    }
+  }
+
+  uint64_t steadyStateAllocations()
+  {
+    int i = 0;
+    for (; i < 500; ++i) {
+      step(i);
+    }
+    const uint64_t start = test::numAllocations();
+    for (; i < 2500; ++i) {
+      step(i);
+    }
+    return test::numAllocations() - start;
+  }
+
+  std::shared_ptr<EkfLocalizationComponent> component_;
+
+private:
+  template<typename SubscriptionT, typename MessageT>
+  static void deliver(const SubscriptionT & subscription, const std::shared_ptr<MessageT> & msg)
+  {
+    std::shared_ptr<void> message = msg;
+    subscription->handle_message(message, rclcpp::MessageInfo());
+  }
+
+  static constexpr int64_t kPeriod = 5000000;
+  std::shared_ptr<sensor_msgs::msg::Imu> imu_{std::make_shared<sensor_msgs::msg::Imu>()};
+  std::shared_ptr<geometry_msgs::msg::PoseStamped> gnss_{
+    std::make_shared<geometry_msgs::msg::PoseStamped>()};
+  std::shared_ptr<nav_msgs::msg::Odometry> odom_{std::make_shared<nav_msgs::msg::Odometry>()};
+};
+
+TEST_F(EkfLocalizationComponentTest, TimerModeDoesNotAllocate)
+{
+  start("timer");
+  EXPECT_EQ(0u, steadyStateAllocations());
+}
+
+TEST_F(EkfLocalizationComponentTest, EventModeDoesNotAllocate)
+{
+  start("event");
+  EXPECT_EQ(0u, steadyStateAllocations());
+}
+}  // namespace kalman_filter_localization
@@ -0,0 +1,128 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "allocation_counter.hpp"
+
+namespace
+{
+using kalman_filter_localization::test::numAllocations;
+
+constexpr double kDt = 0.005;
+constexpr int kNumSteps = 2000;
+
+/*
+* Runs the node's sample mix (imu every step, gnss every 20, late odom every 10) and
+* returns the heap allocations after the warm up, which fills the history.
+*/
+template<typename Estimator>
+uint64_t steadyStateAllocations(
+  const typename Estimator::CovarianceForm covariance_form, const int batch_size,
+  const size_t history_capacity)
+{
+  typedef typename Estimator::Vector3 Vector3;
+  typedef typename Estimator::Matrix3 Matrix3;
+  Estimator ekf(covariance_form);
+  ekf.setPreintegrationBatchSize(batch_size);
+  ekf.setHistoryCapacity(history_capacity);
+  typename Estimator::StateVector x = Estimator::StateVector::Zero();
+  x(Estimator::num_state_ - 1) = 1;  // qw
+  ekf.setInitialX(x);
+
+  const Vector3 gyro(0.01, -0.02, 0.1);
+  const Vector3 linear_acceleration(0.2, 0.1, 9.8);
+  const Vector3 gnss_variance(0.1, 0.1, 0.15);
+  const Matrix3 odom_covariance = Matrix3::Identity() * 0.2;
+  double time = 0;
+  auto step = [&](const int i) {
+      time += kDt;
+      ekf.predictionUpdate(time, gyro, linear_acceleration);
+      if (i % 20 == 0) {
+        ekf.observationUpdateDiagonal(time, Vector3(0.1 * i * kDt, 0, 0), gnss_variance);
+      }
+      if (i % 10 == 5) {
+        ekf.observationUpdate(time - 2 * kDt, Vector3(0.1 * i * kDt, 0, 0), odom_covariance);
+      }
+      if (i % 50 == 0) {
+        ekf.getCoveriance();
+      }
+    };
+
+  int i = 0;
+  for (; i < static_cast<int>(history_capacity) + 100; ++i) {
+    step(i);
+  }
+  const uint64_t start = numAllocations();
+  for (const int end = i + kNumSteps; i < end; ++i) {
+    step(i);
+  }
+  return numAllocations() - start;
+}
+
+template<typename Estimator>
+class EkfAllocationTest : public ::testing::Test
+{
+};
+
+typedef ::testing::Types<EKFEstimator, EKFEstimatorf> Estimators;
+TYPED_TEST_SUITE(EkfAllocationTest, Estimators);
+}  // namespace
+
+TEST(AllocationCounterTest, CountsAllocations)
+{
+  const uint64_t start = numAllocations();
+  std::vector<int> values(16);
+  EXPECT_GT(numAllocations(), start);
+}
+
+TYPED_TEST(EkfAllocationTest, DenseDoesNotAllocate)
+{
+  EXPECT_EQ(0u, steadyStateAllocations<TypeParam>(TypeParam::CovarianceForm::DENSE, 1, 0));
+}
+
+TYPED_TEST(EkfAllocationTest, SquareRootDoesNotAllocate)
+{
+  EXPECT_EQ(0u, steadyStateAllocations<TypeParam>(TypeParam::CovarianceForm::SQUARE_ROOT, 1, 0));
+}
+
+TYPED_TEST(EkfAllocationTest, PreintegrationAndHistoryDoNotAllocate)
+{
+  EXPECT_EQ(
+    0u, steadyStateAllocations<TypeParam>(TypeParam::CovarianceForm::DENSE, 4, 100));
+  EXPECT_EQ(
+    0u, steadyStateAllocations<TypeParam>(TypeParam::CovarianceForm::SQUARE_ROOT, 4, 100));
+}
@@ -0,0 +1,164 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+#include <kalman_filter_localization/ekf_batch.hpp>
+
+#include <type_traits>
+#include <vector>
+
+#include "ekf_test_stream.hpp"
+
+namespace
+{
+using kalman_filter_localization::test::imuSample;
+using kalman_filter_localization::test::positionObservation;
+using kalman_filter_localization::test::relativeError;
+
+// not a multiple of the chunk size below, so the last chunk is partial
+constexpr int kNumFilters = 7;
+constexpr int kChunkSize = 3;
+
+template<typename Scalar>
+class EkfBatchTest : public ::testing::Test
+{
+protected:
+  typedef EKFEstimatorT<Scalar> Estimator;
+  typedef EKFEstimatorBatchT<Scalar> Batch;
+
+  EkfBatchTest()
+  : batch_(kNumFilters), filters_(kNumFilters), y_(kNumFilters, 3),
+    variance_(kNumFilters, 3), gyro_(kNumFilters, 3), acc_(kNumFilters, 3)
+  {
+    batch_.setChunkSize(kChunkSize);
+    for (int k = 0; k < kNumFilters; ++k) {
+      configure(k);
+    }
+  }
+
+  /* lane k gets its own initial position and noise, the scalar filter k the same */
+  void configure(const int k)
+  {
+    typename Estimator::StateVector x = Estimator::StateVector::Zero();
+    x(0) = k;
+    x(4) = 0.1 * k;
+    x(9) = 1;
+    filters_[k] = Estimator();
+    filters_[k].setInitialX(x);
+    filters_[k].setVarImuAcc(0.1 + 0.05 * k);
+    filters_[k].setVarImuGyro(0.02 + 0.01 * k);
+    batch_.setInitialX(k, x);
+    batch_.setVarImuAcc(k, Scalar(0.1 + 0.05 * k));
+    batch_.setVarImuGyro(k, Scalar(0.02 + 0.01 * k));
+  }
+
+  /* sample i of the stream, perturbed per filter */
+  void step(const int i)
+  {
+    const auto sample = imuSample(i);
+    for (int k = 0; k < kNumFilters; ++k) {
+      gyro_.row(k) = (sample.gyro * (1 + 0.1 * k)).template cast<Scalar>().transpose();
+      acc_.row(k) = (sample.acc + Eigen::Vector3d(0.05 * k, 0, 0)).template cast<Scalar>()
+        .transpose();
+      filters_[k].predictionUpdate(
+        sample.stamp, gyro_.row(k).transpose(), acc_.row(k).transpose());
+    }
+    batch_.predictionUpdate(sample.stamp, gyro_, acc_);
+
+    if (i % 10 != 0) {
+      return;
+    }
+    for (int k = 0; k < kNumFilters; ++k) {
+      y_.row(k) = (positionObservation(sample.stamp) + Eigen::Vector3d(k, 0, 0))
+        .template cast<Scalar>().transpose();
+      variance_.row(k) << Scalar(0.5 + 0.1 * k), Scalar(0.5), Scalar(1.0);
+      filters_[k].observationUpdateDiagonal(y_.row(k).transpose(), variance_.row(k).transpose());
+    }
+    batch_.observationUpdate(y_, variance_);
+  }
+
+  void expectLanesMatchFilters(const int i)
+  {
+    // the two round differently (e.g. the scalar filter symmetrizes P), which float shows
+    const double tolerance = std::is_same<Scalar, float>::value ? 1e-3 : 1e-10;
+    for (int k = 0; k < kNumFilters; ++k) {
+      ASSERT_LT(
+        relativeError(
+          batch_.getX(k).template cast<double>(), filters_[k].getX().template cast<double>()),
+        tolerance) << "filter " << k << " at step " << i;
+      ASSERT_LT(
+        relativeError(
+          batch_.getCoveriance(k).template cast<double>(),
+          filters_[k].getCoveriance().template cast<double>()),
+        tolerance) << "filter " << k << " at step " << i;
+    }
+  }
+
+  Batch batch_;
+  std::vector<Estimator> filters_;
+  typename Batch::Lanes3 y_;
+  typename Batch::Lanes3 variance_;
+  typename Batch::Lanes3 gyro_;
+  typename Batch::Lanes3 acc_;
+};
+
+typedef ::testing::Types<double, float> Scalars;
+TYPED_TEST_CASE(EkfBatchTest, Scalars);
+
+/* every lane of the batch follows the scalar filter fed with the same inputs */
+TYPED_TEST(EkfBatchTest, LanesMatchScalarFilters)
+{
+  for (int i = 0; i < 1000; ++i) {
+    this->step(i);
+    if (i % 10 == 0) {
+      this->expectLanesMatchFilters(i);
+    }
+  }
+}
+
+/* resize() restarts the IMU clock, so a new stream starting at t = 0 propagates normally */
+TYPED_TEST(EkfBatchTest, ResizeRestartsTheStream)
+{
+  for (int i = 0; i < 300; ++i) {
+    this->step(i);
+  }
+  this->batch_.resize(kNumFilters);
+  for (int k = 0; k < kNumFilters; ++k) {
+    this->configure(k);
+  }
+  for (int i = 0; i < 300; ++i) {
+    this->step(i);
+  }
+  this->expectLanesMatchFilters(300);
+}
+}  // namespace
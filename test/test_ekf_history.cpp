@@ -0,0 +1,178 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+
+#include <type_traits>
+
+#include "ekf_test_stream.hpp"
+
+namespace
+{
+using kalman_filter_localization::test::imuSample;
+using kalman_filter_localization::test::initialCovariance;
+using kalman_filter_localization::test::positionObservation;
+using kalman_filter_localization::test::relativeError;
+
+constexpr size_t kHistoryCapacity = 50;
+constexpr int kNumSamples = 1000;
+// gnss every 10 samples, delivered 7 samples late; odometry in between, 3 samples late
+constexpr int kObservationPeriod = 10;
+constexpr int kGnssDelay = 7;
+constexpr int kOdomOffset = 5;
+constexpr int kOdomDelay = 3;
+static_assert(
+  kOdomOffset + kOdomDelay > kGnssDelay && kOdomOffset + kOdomDelay < kObservationPeriod,
+  "the odometry is delivered last within an observation period");
+
+template<typename Estimator>
+class EkfHistoryTest : public ::testing::Test
+{
+protected:
+  typedef typename Estimator::Scalar Scalar;
+  typedef typename Estimator::Vector3 Vector3;
+  typedef typename Estimator::Matrix3 Matrix3;
+
+  static void configure(Estimator & ekf)
+  {
+    ekf.setVarImuAcc(0.2);
+    ekf.setVarImuGyro(0.05);
+    ekf.setHistoryCapacity(kHistoryCapacity);
+    ekf.setInitialCovariance(initialCovariance().cast<Scalar>());
+  }
+
+  static void predict(Estimator & ekf, const int i)
+  {
+    const auto sample = imuSample(i);
+    ekf.predictionUpdate(sample.stamp, sample.gyro.cast<Scalar>(), sample.acc.cast<Scalar>());
+  }
+
+  /* the gnss and odometry observations taken at sample i, if any */
+  static void observe(Estimator & ekf, const int i)
+  {
+    const double stamp = imuSample(i).stamp;
+    const Vector3 y = positionObservation(stamp).cast<Scalar>();
+    if (i % kObservationPeriod == 0) {
+      ASSERT_TRUE(ekf.observationUpdateDiagonal(stamp, y, Vector3(0.5, 0.5, 1.0)));
+    } else if (i % kObservationPeriod == kOdomOffset) {
+      Matrix3 covariance;
+      covariance << 0.8, 0.1, 0.0, 0.1, 0.6, 0.05, 0.0, 0.05, 1.2;
+      ASSERT_TRUE(ekf.observationUpdate(stamp, y, covariance));
+    }
+  }
+
+  /*
+* The same IMU and observation stream, once in order and once with every observation
+* delivered a few samples after its stamp, ends in the same x and P.
+*/
+  void expectDelayedMatchesInOrder(const typename Estimator::CovarianceForm form)
+  {
+    const double tolerance = std::is_same<Scalar, float>::value ? 1e-5 : 1e-12;
+    Estimator in_order(form);
+    Estimator delayed(form);
+    configure(in_order);
+    configure(delayed);
+
+    for (int i = 0; i < kNumSamples; ++i) {
+      predict(in_order, i);
+      observe(in_order, i);
+
+      predict(delayed, i);
+      // the observations stamped at the samples that are now kGnssDelay / kOdomDelay old
+      const int gnss_index = i - kGnssDelay;
+      if (gnss_index >= 0 && gnss_index % kObservationPeriod == 0) {
+        observe(delayed, gnss_index);
+      }
+      const int odom_index = i - kOdomDelay;
+      if (odom_index >= 0 && odom_index % kObservationPeriod == kOdomOffset) {
+        observe(delayed, odom_index);
+      }
+
+      // equal once every observation up to here has been delivered to both
+      if (i % kObservationPeriod == kOdomOffset + kOdomDelay) {
+        ASSERT_LT(
+          relativeError(
+            delayed.getX().template cast<double>(), in_order.getX().template cast<double>()),
+          tolerance) << "at step " << i;
+        ASSERT_LT(
+          relativeError(
+            delayed.getCoveriance().template cast<double>(),
+            in_order.getCoveriance().template cast<double>()),
+          tolerance) << "at step " << i;
+      }
+    }
+  }
+
+  /* an observation older than the oldest IMU sample kept is dropped and changes nothing */
+  void expectTooOldIsDropped(const typename Estimator::CovarianceForm form)
+  {
+    Estimator ekf(form);
+    configure(ekf);
+    for (int i = 0; i < 2 * static_cast<int>(kHistoryCapacity); ++i) {
+      predict(ekf, i);
+    }
+    const typename Estimator::StateVector x = ekf.getX();
+    const typename Estimator::EigenMatrix9d P = ekf.getCoveriance();
+
+    const double stamp = imuSample(static_cast<int>(kHistoryCapacity) - 10).stamp;
+    const Vector3 y = positionObservation(stamp).cast<Scalar>();
+    EXPECT_FALSE(ekf.observationUpdateDiagonal(stamp, y, Vector3(0.5, 0.5, 1.0)));
+    EXPECT_FALSE(ekf.observationUpdate(stamp, y, Matrix3::Identity()));
+    EXPECT_EQ(ekf.getX(), x);
+    EXPECT_EQ(ekf.getCoveriance(), P);
+  }
+};
+
+typedef ::testing::Types<EKFEstimator, EKFEstimatorf> Estimators;
+TYPED_TEST_CASE(EkfHistoryTest, Estimators);
+
+TYPED_TEST(EkfHistoryTest, DelayedMatchesInOrderDense)
+{
+  this->expectDelayedMatchesInOrder(TypeParam::CovarianceForm::DENSE);
+}
+
+TYPED_TEST(EkfHistoryTest, DelayedMatchesInOrderSquareRoot)
+{
+  this->expectDelayedMatchesInOrder(TypeParam::CovarianceForm::SQUARE_ROOT);
+}
+
+TYPED_TEST(EkfHistoryTest, TooOldIsDroppedDense)
+{
+  this->expectTooOldIsDropped(TypeParam::CovarianceForm::DENSE);
+}
+
+TYPED_TEST(EkfHistoryTest, TooOldIsDroppedSquareRoot)
+{
+  this->expectTooOldIsDropped(TypeParam::CovarianceForm::SQUARE_ROOT);
+}
+}  // namespace
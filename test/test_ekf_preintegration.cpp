@@ -0,0 +1,123 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+
+#include <type_traits>
+
+#include "ekf_test_stream.hpp"
+
+namespace
+{
+using kalman_filter_localization::test::imuSample;
+using kalman_filter_localization::test::initialCovariance;
+using kalman_filter_localization::test::positionObservation;
+using kalman_filter_localization::test::relativeError;
+
+constexpr int kBatchSize = 8;
+// not a multiple of kBatchSize, so most observations flush a partial batch
+constexpr int kObservationPeriod = 13;
+
+template<typename Estimator>
+class EkfPreintegrationTest : public ::testing::Test
+{
+protected:
+  typedef typename Estimator::Scalar Scalar;
+
+  /*
+* Runs batch size 1 and kBatchSize side by side and compares x and P wherever the batched
+* filter flushes: after every kBatchSize samples since the last flush, and at every
+* observation, which flushes the samples of the batch so far.
+*/
+  void expectSameAtFlushPoints(const typename Estimator::CovarianceForm form)
+  {
+    const double tolerance = std::is_same<Scalar, float>::value ? 1e-4 : 1e-10;
+    Estimator single(form);
+    Estimator batched(form);
+    batched.setPreintegrationBatchSize(kBatchSize);
+    for (Estimator * ekf : {&single, &batched}) {
+      ekf->setVarImuAcc(0.2);
+      ekf->setVarImuGyro(0.05);
+      ekf->setInitialCovariance(initialCovariance().cast<Scalar>());
+    }
+
+    const typename Estimator::Vector3 variance(0.5, 0.5, 1.0);
+    int num_pending = 0;
+    int num_flushes = 0;
+    int num_partial_flushes = 0;
+    for (int i = 0; i < 1000; ++i) {
+      const auto sample = imuSample(i);
+      for (Estimator * ekf : {&single, &batched}) {
+        ekf->predictionUpdate(
+          sample.stamp, sample.gyro.cast<Scalar>(), sample.acc.cast<Scalar>());
+      }
+      ++num_pending;
+      if (i % kObservationPeriod == 0) {
+        const typename Estimator::Vector3 y = positionObservation(sample.stamp).cast<Scalar>();
+        single.observationUpdateDiagonal(y, variance);
+        batched.observationUpdateDiagonal(y, variance);
+        num_partial_flushes += num_pending < kBatchSize ? 1 : 0;
+      } else if (num_pending < kBatchSize) {
+        continue;
+      }
+      num_pending = 0;
+      ++num_flushes;
+
+      ASSERT_LT(
+        relativeError(
+          batched.getX().template cast<double>(), single.getX().template cast<double>()),
+        tolerance) << "at step " << i;
+      ASSERT_LT(
+        relativeError(
+          batched.getCoveriance().template cast<double>(),
+          single.getCoveriance().template cast<double>()),
+        tolerance) << "at step " << i;
+    }
+    EXPECT_GT(num_flushes, 100);
+    EXPECT_GT(num_partial_flushes, 50);
+  }
+};
+
+typedef ::testing::Types<EKFEstimator, EKFEstimatorf> Estimators;
+TYPED_TEST_CASE(EkfPreintegrationTest, Estimators);
+
+TYPED_TEST(EkfPreintegrationTest, Dense)
+{
+  this->expectSameAtFlushPoints(TypeParam::CovarianceForm::DENSE);
+}
+
+TYPED_TEST(EkfPreintegrationTest, SquareRoot)
+{
+  this->expectSameAtFlushPoints(TypeParam::CovarianceForm::SQUARE_ROOT);
+}
+}  // namespace
@@ -0,0 +1,115 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+
+#include "ekf_test_stream.hpp"
+
+namespace
+{
+using kalman_filter_localization::test::imuSample;
+using kalman_filter_localization::test::initialCovariance;
+using kalman_filter_localization::test::relativeError;
+
+typedef Eigen::Matrix<double, 9, 9> Matrix9d;
+
+/*
+* the reference P_k = F P_{k-1} F^T + L Q L^T with the full 9x9 products, evaluated in double
+* on the state before the prediction
+*/
+Matrix9d denseCovariance(
+  const Matrix9d & P, const Eigen::Matrix<double, 10, 1> & x, const Eigen::Vector3d & acc,
+  const double dt, const double var_acc, const double var_w)
+{
+  const Eigen::Matrix3d rot_mat = Eigen::Quaterniond(x(9), x(6), x(7), x(8)).toRotationMatrix();
+  Eigen::Matrix3d acc_skew;
+  acc_skew << 0, -acc(2), acc(1), acc(2), 0, -acc(0), -acc(1), acc(0), 0;
+
+  Matrix9d F = Matrix9d::Identity();
+  F.block<3, 3>(0, 3) = dt * Eigen::Matrix3d::Identity();
+  F.block<3, 3>(3, 6) = rot_mat * (-acc_skew) * dt;
+
+  Eigen::Matrix<double, 6, 6> Q = Eigen::Matrix<double, 6, 6>::Identity();
+  Q.block<3, 3>(0, 0) *= var_acc * dt * dt;
+  Q.block<3, 3>(3, 3) *= var_w * dt * dt;
+
+  Eigen::Matrix<double, 9, 6> L = Eigen::Matrix<double, 9, 6>::Zero();
+  L.block<3, 3>(3, 0) = Eigen::Matrix3d::Identity();
+  L.block<3, 3>(6, 3) = Eigen::Matrix3d::Identity();
+
+  return F * P * F.transpose() + L * Q * L.transpose();
+}
+
+template<typename Estimator>
+class EkfPropagationTest : public ::testing::Test
+{
+};
+
+typedef ::testing::Types<EKFEstimator, EKFEstimatorf> Estimators;
+TYPED_TEST_CASE(EkfPropagationTest, Estimators);
+
+/*
+* Every sample's propagation (block-wise, or the dense product when this file is built
+* with KFL_EKF_DENSE_COVARIANCE_PROPAGATION) matches the dense reference.
+*/
+TYPED_TEST(EkfPropagationTest, MatchesDenseProduct)
+{
+  typedef typename TypeParam::Scalar Scalar;
+  typedef typename TypeParam::Vector3 Vector3;
+  const double tolerance = std::is_same<Scalar, float>::value ? 1e-5 : 1e-12;
+  const double var_acc = 0.2;
+  const double var_w = 0.05;
+
+  TypeParam ekf;
+  ekf.setVarImuAcc(var_acc);
+  ekf.setVarImuGyro(var_w);
+  ekf.setInitialCovariance(initialCovariance().cast<Scalar>());
+
+  double previous_stamp = 0.0;
+  for (int i = 0; i < 400; ++i) {
+    const auto sample = imuSample(i);
+    const Matrix9d P = ekf.getCoveriance().template cast<double>();
+    const Eigen::Matrix<double, 10, 1> x = ekf.getX().template cast<double>();
+    const Vector3 acc = sample.acc.cast<Scalar>();
+
+    ekf.predictionUpdate(sample.stamp, sample.gyro.cast<Scalar>(), acc);
+
+    const Matrix9d expected = denseCovariance(
+      P, x, acc.template cast<double>(), static_cast<double>(
+        static_cast<Scalar>(sample.stamp - previous_stamp)), var_acc, var_w);
+    previous_stamp = sample.stamp;
+    ASSERT_LT(relativeError(ekf.getCoveriance().template cast<double>(), expected), tolerance)
+      << "at sample " << i;
+  }
+}
+}  // namespace
@@ -0,0 +1,111 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+
+#include <type_traits>
+
+#include "ekf_test_stream.hpp"
+
+namespace
+{
+using kalman_filter_localization::test::imuSample;
+using kalman_filter_localization::test::initialCovariance;
+using kalman_filter_localization::test::positionObservation;
+using kalman_filter_localization::test::relativeError;
+
+template<typename Estimator>
+class EkfSquareRootTest : public ::testing::Test
+{
+};
+
+typedef ::testing::Types<EKFEstimator, EKFEstimatorf> Estimators;
+TYPED_TEST_CASE(EkfSquareRootTest, Estimators);
+
+template<typename Matrix>
+void expectSymmetricPositiveDefinite(const Matrix & P, const double tolerance, const int step)
+{
+  const auto Pd = P.template cast<double>();
+  EXPECT_LT(relativeError(Pd, Pd.transpose()), tolerance) << "at step " << step;
+  EXPECT_EQ(Pd.llt().info(), Eigen::Success) << "at step " << step;
+}
+
+/*
+* DENSE and SQUARE_ROOT run the same IMU stream with diagonal and full observation
+* covariances and report the same P, which stays symmetric positive definite in both.
+*/
+TYPED_TEST(EkfSquareRootTest, MatchesDense)
+{
+  typedef typename TypeParam::Scalar Scalar;
+  typedef typename TypeParam::Vector3 Vector3;
+  typedef typename TypeParam::Matrix3 Matrix3;
+  const bool is_float = std::is_same<Scalar, float>::value;
+  const double tolerance = is_float ? 1e-4 : 1e-9;
+
+  TypeParam dense(TypeParam::CovarianceForm::DENSE);
+  TypeParam square_root(TypeParam::CovarianceForm::SQUARE_ROOT);
+  for (TypeParam * ekf : {&dense, &square_root}) {
+    ekf->setVarImuAcc(0.2);
+    ekf->setVarImuGyro(0.05);
+    ekf->setInitialCovariance(initialCovariance().cast<Scalar>());
+  }
+
+  const Vector3 variance(0.5, 0.5, 1.0);
+  Matrix3 covariance;
+  covariance << 0.8, 0.1, 0.0, 0.1, 0.6, 0.05, 0.0, 0.05, 1.2;
+  for (int i = 0; i < 2000; ++i) {
+    const auto sample = imuSample(i);
+    const Vector3 y = positionObservation(sample.stamp).cast<Scalar>();
+    for (TypeParam * ekf : {&dense, &square_root}) {
+      ekf->predictionUpdate(sample.stamp, sample.gyro.cast<Scalar>(), sample.acc.cast<Scalar>());
+      if (i % 20 == 0) {
+        ekf->observationUpdateDiagonal(y, variance);
+      } else if (i % 50 == 25) {
+        ekf->observationUpdate(y, covariance);
+      }
+    }
+    if (i % 10 != 0) {
+      continue;
+    }
+    const auto P_dense = dense.getCoveriance().template cast<double>();
+    const auto P_square_root = square_root.getCoveriance().template cast<double>();
+    ASSERT_LT(relativeError(P_square_root, P_dense), tolerance) << "at step " << i;
+    ASSERT_LT(
+      relativeError(
+        square_root.getX().template cast<double>(), dense.getX().template cast<double>()),
+      tolerance) << "at step " << i;
+    expectSymmetricPositiveDefinite(P_dense, tolerance, i);
+    expectSymmetricPositiveDefinite(P_square_root, tolerance, i);
+  }
+}
+}  // namespace
@@ -0,0 +1,129 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/ekf.hpp>
+
+#include <type_traits>
+
+#include "ekf_test_stream.hpp"
+
+namespace
+{
+using kalman_filter_localization::test::imuSample;
+using kalman_filter_localization::test::initialCovariance;
+using kalman_filter_localization::test::positionObservation;
+using kalman_filter_localization::test::relativeError;
+
+template<typename Estimator>
+class EkfUpdateTest : public ::testing::Test
+{
+};
+
+typedef ::testing::Types<EKFEstimator, EKFEstimatorf> Estimators;
+TYPED_TEST_CASE(EkfUpdateTest, Estimators);
+
+/*
+* For a diagonal R the sequential scalar updates give the x and P of the joint Joseph-form
+* update. The inputs are passed as Eigen expressions of double, as the node does.
+*/
+TYPED_TEST(EkfUpdateTest, SequentialMatchesJointJoseph)
+{
+  typedef typename TypeParam::Scalar Scalar;
+  const double tolerance = std::is_same<Scalar, float>::value ? 1e-4 : 1e-10;
+
+  TypeParam sequential;
+  TypeParam joint;
+  joint.setSequentialUpdate(false);
+  joint.setJosephForm(true);
+  for (TypeParam * ekf : {&sequential, &joint}) {
+    ekf->setVarImuAcc(0.2);
+    ekf->setVarImuGyro(0.05);
+    ekf->setInitialCovariance(initialCovariance().cast<Scalar>());
+  }
+
+  const Eigen::Vector3d variance(0.3, 0.5, 1.5);
+  for (int i = 0; i < 1000; ++i) {
+    const auto sample = imuSample(i);
+    for (TypeParam * ekf : {&sequential, &joint}) {
+      ekf->predictionUpdate(sample.stamp, sample.gyro.cast<Scalar>(), sample.acc.cast<Scalar>());
+    }
+    if (i % 10 != 0) {
+      continue;
+    }
+    const Eigen::Vector3d y = positionObservation(sample.stamp);
+    sequential.observationUpdateDiagonal(y.cast<Scalar>(), variance.cast<Scalar>());
+    joint.observationUpdateDiagonal(y.cast<Scalar>(), variance.cast<Scalar>());
+
+    ASSERT_LT(
+      relativeError(
+        sequential.getX().template cast<double>(), joint.getX().template cast<double>()),
+      tolerance) << "at step " << i;
+    ASSERT_LT(
+      relativeError(
+        sequential.getCoveriance().template cast<double>(),
+        joint.getCoveriance().template cast<double>()),
+      tolerance) << "at step " << i;
+  }
+}
+
+/* a full R equal to diag(variance) takes the joint update and lands on the same result */
+TYPED_TEST(EkfUpdateTest, FullCovarianceMatchesDiagonal)
+{
+  typedef typename TypeParam::Scalar Scalar;
+  const double tolerance = std::is_same<Scalar, float>::value ? 1e-4 : 1e-10;
+
+  TypeParam diagonal;
+  TypeParam full;
+  const Eigen::Vector3d variance(0.3, 0.5, 1.5);
+  const Eigen::Matrix3d covariance = variance.asDiagonal();
+  for (int i = 0; i < 200; ++i) {
+    const auto sample = imuSample(i);
+    for (TypeParam * ekf : {&diagonal, &full}) {
+      ekf->predictionUpdate(sample.stamp, sample.gyro.cast<Scalar>(), sample.acc.cast<Scalar>());
+    }
+    if (i % 10 == 0) {
+      const Eigen::Vector3d y = positionObservation(sample.stamp);
+      diagonal.observationUpdateDiagonal(y.cast<Scalar>(), variance.cast<Scalar>());
+      full.observationUpdate(y.cast<Scalar>(), covariance.cast<Scalar>());
+    }
+  }
+  EXPECT_LT(
+    relativeError(diagonal.getX().template cast<double>(), full.getX().template cast<double>()),
+    tolerance);
+  EXPECT_LT(
+    relativeError(
+      diagonal.getCoveriance().template cast<double>(),
+      full.getCoveriance().template cast<double>()),
+    tolerance);
+}
+}  // namespace
@@ -0,0 +1,137 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/fusion_queue.hpp>
+
+#include <vector>
+
+namespace
+{
+/* drains every ready item */
+std::vector<int> drain(FusionQueue<int> & queue)
+{
+  std::vector<int> items;
+  while (queue.ready()) {
+    items.push_back(queue.pop());
+  }
+  return items;
+}
+
+TEST(FusionQueueTest, OrdersWithinReorderWindow)
+{
+  FusionQueue<int> queue;
+  queue.reset(16, 10);
+  // out of order, all within 10 of the newest stamp: nothing is ready yet
+  EXPECT_TRUE(queue.push(100, 100));
+  EXPECT_TRUE(queue.push(95, 95));
+  EXPECT_TRUE(queue.push(103, 103));
+  EXPECT_TRUE(queue.push(98, 98));
+  EXPECT_FALSE(queue.ready());
+  EXPECT_EQ(queue.size(), 4u);
+
+  // 110 releases everything at or before 100, oldest first
+  EXPECT_TRUE(queue.push(110, 110));
+  EXPECT_EQ(drain(queue), (std::vector<int>{95, 98, 100}));
+  EXPECT_EQ(queue.size(), 2u);
+
+  EXPECT_TRUE(queue.push(125, 125));
+  EXPECT_EQ(drain(queue), (std::vector<int>{103, 110}));
+  EXPECT_EQ(queue.maxSize(), 5u);
+  EXPECT_EQ(queue.dropped(), 0u);
+}
+
+TEST(FusionQueueTest, EqualStampsKeepPushOrder)
+{
+  FusionQueue<int> queue;
+  queue.reset(16, 0);
+  queue.push(10, 1);
+  queue.push(10, 2);
+  queue.push(5, 0);
+  queue.push(10, 3);
+  EXPECT_EQ(drain(queue), (std::vector<int>{0, 1, 2, 3}));
+}
+
+TEST(FusionQueueTest, LateSamplesAreDropped)
+{
+  FusionQueue<int> queue;
+  queue.reset(16, 10);
+  queue.push(100, 100);
+  queue.push(120, 120);
+  EXPECT_EQ(drain(queue), (std::vector<int>{100}));
+
+  // behind the last drained stamp; the stamp itself is still in order
+  EXPECT_TRUE(queue.late(99));
+  EXPECT_FALSE(queue.late(100));
+  EXPECT_FALSE(queue.late(105));
+  EXPECT_FALSE(queue.push(99, 99));
+  EXPECT_EQ(queue.dropped(), 1u);
+  EXPECT_TRUE(queue.push(100, 101));
+  EXPECT_EQ(queue.dropped(), 1u);
+  EXPECT_EQ(queue.size(), 2u);
+}
+
+TEST(FusionQueueTest, FullQueueDrops)
+{
+  FusionQueue<int> queue;
+  queue.reset(2, 1000);
+  EXPECT_TRUE(queue.push(1, 1));
+  EXPECT_TRUE(queue.push(2, 2));
+  EXPECT_TRUE(queue.full());
+  EXPECT_FALSE(queue.push(3, 3));
+  EXPECT_EQ(queue.dropped(), 1u);
+
+  // the caller makes room by popping the oldest, ready or not
+  EXPECT_FALSE(queue.ready());
+  EXPECT_EQ(queue.pop(), 1);
+  EXPECT_TRUE(queue.push(3, 3));
+  EXPECT_EQ(queue.size(), 2u);
+}
+
+TEST(FusionQueueTest, ResetClearsItemsAndCounters)
+{
+  FusionQueue<int> queue;
+  queue.reset(1, 0);
+  queue.push(10, 10);
+  queue.push(20, 20);
+  EXPECT_EQ(queue.pop(), 10);
+  EXPECT_EQ(queue.dropped(), 1u);
+
+  queue.reset(4, 0);
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(queue.dropped(), 0u);
+  EXPECT_EQ(queue.maxSize(), 0u);
+  // no longer late after the reset
+  EXPECT_FALSE(queue.late(5));
+  EXPECT_TRUE(queue.push(5, 5));
+}
+}  // namespace
@@ -0,0 +1,131 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/latency_histogram.hpp>
+
+#include <cstdint>
+
+namespace
+{
+/* p50 of one value and a much larger one is the upper bound of the smaller one's bucket */
+int64_t bucketUpperBound(LatencyHistogram & histogram, const int64_t value)
+{
+  histogram.record(value);
+  histogram.record(value * 100 + 100);
+  return histogram.drain().p50;
+}
+
+TEST(LatencyHistogramTest, SmallValuesAreExact)
+{
+  LatencyHistogram histogram;
+  for (int64_t value = 0; value < 16; ++value) {
+    EXPECT_EQ(bucketUpperBound(histogram, value), value);
+  }
+}
+
+TEST(LatencyHistogramTest, BucketBoundaries)
+{
+  LatencyHistogram histogram;
+  // 16..31 in buckets of 2, 1024..2047 in buckets of 128
+  EXPECT_EQ(bucketUpperBound(histogram, 16), 17);
+  EXPECT_EQ(bucketUpperBound(histogram, 17), 17);
+  EXPECT_EQ(bucketUpperBound(histogram, 18), 19);
+  EXPECT_EQ(bucketUpperBound(histogram, 1023), 1023);
+  EXPECT_EQ(bucketUpperBound(histogram, 1024), 1151);
+  EXPECT_EQ(bucketUpperBound(histogram, 1151), 1151);
+  EXPECT_EQ(bucketUpperBound(histogram, 1152), 1279);
+  EXPECT_EQ(bucketUpperBound(histogram, 2047), 2047);
+
+  // every bucket is at most 12.5% of its values wide
+  for (int64_t value = 8; value < (int64_t{1} << 40); value += value / 3 + 1) {
+    const int64_t upper_bound = bucketUpperBound(histogram, value);
+    EXPECT_GE(upper_bound, value);
+    EXPECT_LE(upper_bound - value, value / 8) << "value " << value;
+  }
+}
+
+TEST(LatencyHistogramTest, OutOfRangeValues)
+{
+  LatencyHistogram histogram;
+  // from 2^41 on everything shares the last bucket, whose upper bound is 2^41 - 1
+  histogram.record(int64_t{1} << 45);
+  histogram.record(int64_t{1} << 46);
+  LatencyHistogram::Summary summary = histogram.drain();
+  EXPECT_EQ(summary.p50, (int64_t{1} << 41) - 1);
+  EXPECT_EQ(summary.max, int64_t{1} << 46);
+
+  // negative durations count as 0
+  histogram.record(-5);
+  summary = histogram.drain();
+  EXPECT_EQ(summary.count, 1u);
+  EXPECT_EQ(summary.p50, 0);
+  EXPECT_EQ(summary.mean, 0.0);
+}
+
+TEST(LatencyHistogramTest, Summary)
+{
+  LatencyHistogram histogram;
+  for (int64_t value = 1; value <= 100; ++value) {
+    histogram.record(value);
+  }
+  const LatencyHistogram::Summary summary = histogram.drain();
+  EXPECT_EQ(summary.count, 100u);
+  EXPECT_DOUBLE_EQ(summary.mean, 50.5);
+  EXPECT_EQ(summary.max, 100);
+  // the bucket upper bounds of the 50th, 90th and 99th value
+  EXPECT_EQ(summary.p50, 51);
+  EXPECT_EQ(summary.p90, 95);
+  EXPECT_EQ(summary.p99, 100);
+}
+
+TEST(LatencyHistogramTest, DrainResets)
+{
+  LatencyHistogram histogram;
+  histogram.record(1000);
+  histogram.record(3000);
+  EXPECT_EQ(histogram.drain().count, 2u);
+
+  LatencyHistogram::Summary summary = histogram.drain();
+  EXPECT_EQ(summary.count, 0u);
+  EXPECT_EQ(summary.mean, 0.0);
+  EXPECT_EQ(summary.max, 0);
+  EXPECT_EQ(summary.p99, 0);
+
+  // the next interval starts from scratch, including the max
+  histogram.record(10);
+  summary = histogram.drain();
+  EXPECT_EQ(summary.count, 1u);
+  EXPECT_EQ(summary.max, 10);
+  EXPECT_EQ(summary.p50, 10);
+}
+}  // namespace
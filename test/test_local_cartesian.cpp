@@ -0,0 +1,103 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/local_cartesian.hpp>
+
+#include <Eigen/Core>
+
+namespace
+{
+using kalman_filter_localization::LocalCartesian;
+
+/*
+* The reference values are the textbook WGS84 geodetic -> ECEF -> ENU conversion evaluated
+* independently in double (Python), to well below the 1 mm tolerance.
+*/
+constexpr double kTolerance = 1e-3;  // [m]
+
+void expectNear(const Eigen::Vector3d & actual, const Eigen::Vector3d & expected)
+{
+  EXPECT_NEAR(actual.x(), expected.x(), kTolerance);
+  EXPECT_NEAR(actual.y(), expected.y(), kTolerance);
+  EXPECT_NEAR(actual.z(), expected.z(), kTolerance);
+}
+
+TEST(LocalCartesianTest, Ecef)
+{
+  // equator at the prime meridian and at 90 deg east: the semi-major axis
+  expectNear(LocalCartesian::toEcef(0, 0, 0), Eigen::Vector3d(6378137.0, 0, 0));
+  expectNear(LocalCartesian::toEcef(0, 90, 0), Eigen::Vector3d(0, 6378137.0, 0));
+  // north pole: the semi-minor axis, plus the altitude
+  expectNear(LocalCartesian::toEcef(90, 0, 0), Eigen::Vector3d(0, 0, 6356752.314245));
+  expectNear(LocalCartesian::toEcef(90, 0, 100), Eigen::Vector3d(0, 0, 6356852.314245));
+  expectNear(
+    LocalCartesian::toEcef(35.6812, 139.7671, 40),
+    Eigen::Vector3d(-3959690.802569, 3350097.500459, 3699540.124670));
+}
+
+TEST(LocalCartesianTest, Origin)
+{
+  LocalCartesian local_cartesian;
+  EXPECT_FALSE(local_cartesian.hasOrigin());
+  local_cartesian.setOrigin(35.6812, 139.7671, 40);
+  EXPECT_TRUE(local_cartesian.hasOrigin());
+  expectNear(local_cartesian.forward(35.6812, 139.7671, 40), Eigen::Vector3d::Zero());
+  // straight up
+  expectNear(local_cartesian.forward(35.6812, 139.7671, 140), Eigen::Vector3d(0, 0, 100));
+
+  local_cartesian.reset();
+  EXPECT_FALSE(local_cartesian.hasOrigin());
+}
+
+TEST(LocalCartesianTest, KilometerOffsets)
+{
+  LocalCartesian local_cartesian;
+  local_cartesian.setOrigin(35.6812, 139.7671, 40);
+  // about 1 km east and north; the ground drops below the tangent plane by ~8 cm
+  expectNear(
+    local_cartesian.forward(35.6812, 139.7781, 40),
+    Eigen::Vector3d(995.783194, 0.055754, -0.077644));
+  expectNear(
+    local_cartesian.forward(35.6902, 139.7671, 40), Eigen::Vector3d(0, 998.584945, -0.078429));
+  expectNear(
+    local_cartesian.forward(35.6752, 139.7741, 55.5),
+    Eigen::Vector3d(633.729191, -665.701510, 15.433698));
+
+  // a new origin replaces the old one
+  local_cartesian.setOrigin(42, -82, 200);
+  expectNear(local_cartesian.forward(42, -82, 200), Eigen::Vector3d::Zero());
+  expectNear(
+    local_cartesian.forward(42.002582, -81.997752, 1139.7018),
+    Eigen::Vector3d(186.274212, 286.845088, 939.692621));
+}
+}  // namespace
@@ -0,0 +1,124 @@
+// Copyright (c) 2020, Ryohei Sasaki
+// All rights reserved.
+//
+// Software License Agreement (BSD License 2.0)
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+//  * Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above
+//    copyright notice, this list of conditions and the following
+//    disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//  * Neither the name of {copyright_holder} nor the names of its
+//    contributors may be used to endorse or promote products derived
+//    from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+// FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+// COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+// INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+// BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+// ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+#include <gtest/gtest.h>
+
+#include <kalman_filter_localization/seqlock.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace
+{
+/* every field holds the same counter, so a torn read shows as a mismatch */
+struct Value
+{
+  uint64_t counter;
+  uint64_t copies[31];
+  double scaled;
+};
+
+Value makeValue(const uint64_t counter)
+{
+  Value value;
+  value.counter = counter;
+  for (uint64_t & copy : value.copies) {
+    copy = counter;
+  }
+  value.scaled = 0.5 * static_cast<double>(counter);
+  return value;
+}
+
+TEST(SeqLockTest, LoadReturnsTheLastStore)
+{
+  SeqLock<Value> seqlock;
+  EXPECT_EQ(seqlock.load().counter, 0u);
+  seqlock.store(makeValue(42));
+  const Value value = seqlock.load();
+  EXPECT_EQ(value.counter, 42u);
+  EXPECT_EQ(value.copies[30], 42u);
+  EXPECT_EQ(value.scaled, 21.0);
+}
+
+/* readers racing one writer only ever see whole values, in store order */
+TEST(SeqLockTest, ReadersSeeConsistentValues)
+{
+  constexpr uint64_t kNumStores = 200000;
+  constexpr int kNumReaders = 3;
+  SeqLock<Value> seqlock;
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> num_torn{0};
+  std::atomic<uint64_t> num_reordered{0};
+  std::atomic<uint64_t> num_loads{0};
+
+  std::vector<std::thread> readers;
+  for (int r = 0; r < kNumReaders; ++r) {
+    readers.emplace_back(
+      [&]() {
+        uint64_t previous = 0;
+        uint64_t loads = 0;
+        while (!done.load(std::memory_order_acquire)) {
+          const Value value = seqlock.load();
+          for (const uint64_t copy : value.copies) {
+            if (copy != value.counter) {
+              ++num_torn;
+              break;
+            }
+          }
+          if (value.scaled != 0.5 * static_cast<double>(value.counter)) {
+            ++num_torn;
+          }
+          if (value.counter < previous) {
+            ++num_reordered;
+          }
+          previous = value.counter;
+          ++loads;
+        }
+        num_loads += loads;
+      });
+  }
+
+  for (uint64_t counter = 1; counter <= kNumStores; ++counter) {
+    seqlock.store(makeValue(counter));
+  }
+  done.store(true, std::memory_order_release);
+  for (std::thread & reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_EQ(num_torn.load(), 0u);
+  EXPECT_EQ(num_reordered.load(), 0u);
+  EXPECT_GT(num_loads.load(), 0u);
+  EXPECT_EQ(seqlock.load().counter, kNumStores);
+}
+}  // namespace